@@ -0,0 +1,43 @@
+/* vi: set sw=8 ts=8: */
+// bench.h
+//
+// ext2 filesystem generator for embedded systems
+//
+// Please direct support requests to https://github.com/bestouff/genext2fs/issues
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; version
+// 2 of the License.
+
+// Timing and random numbers shared by the micro-benchmarks.  The
+// random numbers come from a fixed seed so that every run, and every
+// implementation in a run, sees the same sequence.
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static inline double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline unsigned int
+bench_rand(unsigned long long *seed)
+{
+	*seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	return *seed >> 33;
+}
+
+// keeps the compiler from dropping a computation whose result is unused
+static volatile unsigned long bench_sink;
+
+#endif /* __BENCH_H__ */
@@ -0,0 +1,174 @@
+/* vi: set sw=8 ts=8: */
+// bitmap_bench.c
+//
+// ext2 filesystem generator for embedded systems
+//
+// Please direct support requests to https://github.com/bestouff/genext2fs/issues
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; version
+// 2 of the License.
+
+// Compares the bitmap helpers of bitops.h with the loops they replaced
+// in allocate and init_fs, on 1K and 4K block bitmaps:
+//
+//  - finding the first free bit of a full bitmap, which is what every
+//    allocation in a group that is filling up costs, against the byte
+//    loop of allocate;
+//  - marking the system blocks of a group, against one allocate call
+//    per block;
+//  - finding the first run of n free bits in a fragmented bitmap,
+//    against testing one bit at a time.  The results of the three are
+//    checked against each other.
+//
+// The portable column is bitops.h without its SSE2 path.
+
+#include <config.h>
+
+#include "bench.h"
+#include "bitops.h"
+#include "bitops_portable.h"
+
+#define MAX_BYTES 4096
+
+static unsigned char bm[MAX_BYTES];
+
+// the scan of allocate before bitops.h, returns a bit number
+static unsigned int
+old_find_zero(const unsigned char *b, unsigned int bytes)
+{
+	unsigned int i;
+
+	for (i = 0; i < bytes; i++)
+		if (b[i] != (unsigned char)-1)
+			return i * 8 + __builtin_ctz(~b[i]);
+	return bytes * 8;
+}
+
+// the marking loop of init_fs before bitops.h
+static void
+old_fill(unsigned char *b, unsigned int start, unsigned int end)
+{
+	unsigned int i;
+
+	for (i = start; i < end; i++)
+		b[i / 8] |= 1 << (i % 8);
+}
+
+static unsigned int
+naive_find_zero_run(const unsigned char *b, unsigned int start,
+		    unsigned int end, unsigned int n)
+{
+	unsigned int i, len = 0;
+
+	for (i = start; i < end; i++) {
+		if (b[i / 8] & (1 << (i % 8)))
+			len = 0;
+		else if (++len == n)
+			return i + 1 - n;
+	}
+	return end;
+}
+
+#define TIME(res, reps, expr) do { \
+	unsigned int r_; \
+	double t_ = bench_now(); \
+	for (r_ = 0; r_ < (reps); r_++) { \
+		bench_sink += (expr); \
+		__asm__ __volatile__("" : : : "memory"); \
+	} \
+	(res) = (bench_now() - t_) * 1e9 / (reps); \
+} while (0)
+
+static void
+bench_find_zero(unsigned int bytes)
+{
+	double old, port, word;
+	unsigned int i;
+
+	// and a clear bit at each position, for the three to agree on
+	for (i = 0; i < bytes * 8; i += 61) {
+		memset(bm, 0xff, bytes);
+		bm[i / 8] &= ~(1 << (i % 8));
+		if (old_find_zero(bm, bytes) != i
+		    || bitmap_find_zero_portable(bm, 0, bytes * 8) != i
+		    || bitmap_find_zero(bm, 0, bytes * 8) != i) {
+			fprintf(stderr, "bitmap_bench: first zero at %u\n", i);
+			exit(1);
+		}
+	}
+	memset(bm, 0xff, bytes);
+	TIME(old, 100000, old_find_zero(bm, bytes));
+	TIME(port, 100000, bitmap_find_zero_portable(bm, 0, bytes * 8));
+	TIME(word, 100000, bitmap_find_zero(bm, 0, bytes * 8));
+	printf("%-28s %5u %10.1f %10.1f %10.1f %7.1fx\n", "first zero, full bitmap",
+	       bytes * 8, old, port, word, old / word);
+}
+
+static void
+bench_fill(unsigned int bytes)
+{
+	// a 1K bitmap group holds 8192 blocks, of which 256 are inode
+	// table with 2048 inodes; a 4K one 32768, with 512 and 8192
+	unsigned int bits = bytes == 1024 ? 256 + 3 : 512 + 3;
+	double old, word;
+
+	TIME(old, 100000, (memset(bm, 0, bytes), old_fill(bm, 0, bits), bm[0]));
+	TIME(word, 100000, (memset(bm, 0, bytes), bitmap_fill(bm, 0, bits, 1), bm[0]));
+	printf("%-28s %5u %10.1f %10s %10.1f %7.1fx\n", "mark system blocks",
+	       bits, old, "-", word, old / word);
+}
+
+static void
+bench_zero_run(unsigned int bytes, unsigned int n)
+{
+	unsigned long long seed = 1;
+	unsigned int i, bits = bytes * 8, a, b, c;
+	double old, port, word;
+	char name[32];
+
+	// used runs of 1 to 64 blocks and free runs of 1 to n blocks, with
+	// a single free run of n at the end
+	memset(bm, 0, bytes);
+	for (i = 0; i + n < bits;) {
+		a = 1 + bench_rand(&seed) % 64;
+		if (a > bits - n - i)
+			a = bits - n - i;
+		bitmap_fill(bm, i, i + a, 1);
+		i += a + 1 + bench_rand(&seed) % (n - 1);
+	}
+	for (i = 0; i < bits; i += 97) {
+		a = naive_find_zero_run(bm, i, bits, n);
+		b = bitmap_find_zero_run_portable(bm, i, bits, n);
+		c = bitmap_find_zero_run(bm, i, bits, n);
+		if (a != b || a != c) {
+			fprintf(stderr, "bitmap_bench: run of %u from %u: "
+				"%u, %u, %u\n", n, i, a, b, c);
+			exit(1);
+		}
+	}
+	TIME(old, 10000, naive_find_zero_run(bm, 0, bits, n));
+	TIME(port, 10000, bitmap_find_zero_run_portable(bm, 0, bits, n));
+	TIME(word, 10000, bitmap_find_zero_run(bm, 0, bits, n));
+	snprintf(name, sizeof(name), "run of %u zeros, fragmented", n);
+	printf("%-28s %5u %10.1f %10.1f %10.1f %7.1fx\n", name,
+	       bits, old, port, word, old / word);
+}
+
+int
+main(void)
+{
+	static const unsigned int bytes[] = { 1024, 4096 };
+	unsigned int i;
+
+	printf("%-28s %5s %10s %10s %10s %8s\n", "ns/op", "bits",
+	       "old", "portable", "bitops.h", "speedup");
+	for (i = 0; i < sizeof(bytes) / sizeof(bytes[0]); i++) {
+		bench_find_zero(bytes[i]);
+		bench_fill(bytes[i]);
+		bench_zero_run(bytes[i], 16);
+		bench_zero_run(bytes[i], 256);
+	}
+	return 0;
+}
@@ -0,0 +1,41 @@
+/* vi: set sw=8 ts=8: */
+// bitops_portable.c
+//
+// ext2 filesystem generator for embedded systems
+//
+// Please direct support requests to https://github.com/bestouff/genext2fs/issues
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; version
+// 2 of the License.
+
+// The helpers of bitops.h without their SIMD paths, for the benchmarks
+// to compare with the ones the build uses.
+
+#include <config.h>
+
+#define BITOPS_NO_SIMD 1
+#include "bitops.h"
+
+#include "bitops_portable.h"
+
+size_t
+first_nonzero_portable(const unsigned char *b, size_t len)
+{
+	return first_nonzero(b, len);
+}
+
+unsigned int
+bitmap_find_zero_portable(const unsigned char *b, unsigned int start,
+			  unsigned int end)
+{
+	return bitmap_find_zero(b, start, end);
+}
+
+unsigned int
+bitmap_find_zero_run_portable(const unsigned char *b, unsigned int start,
+			      unsigned int end, unsigned int n)
+{
+	return bitmap_find_zero_run(b, start, end, n);
+}
@@ -0,0 +1,25 @@
+/* vi: set sw=8 ts=8: */
+// bitops_portable.h
+//
+// ext2 filesystem generator for embedded systems
+//
+// Please direct support requests to https://github.com/bestouff/genext2fs/issues
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; version
+// 2 of the License.
+
+#ifndef __BITOPS_PORTABLE_H__
+#define __BITOPS_PORTABLE_H__
+
+#include <stddef.h>
+
+size_t first_nonzero_portable(const unsigned char *b, size_t len);
+unsigned int bitmap_find_zero_portable(const unsigned char *b,
+				       unsigned int start, unsigned int end);
+unsigned int bitmap_find_zero_run_portable(const unsigned char *b,
+					   unsigned int start, unsigned int end,
+					   unsigned int n);
+
+#endif /* __BITOPS_PORTABLE_H__ */
@@ -0,0 +1,43 @@
+/* vi: set sw=8 ts=8: */
+// cache_bench.c
+//
+// ext2 filesystem generator for embedded systems
+//
+// Please direct support requests to https://github.com/bestouff/genext2fs/issues
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; version
+// 2 of the License.
+
+// Compares the open addressing listcache of cache.h with the chained
+// one it replaced, on the block cache accesses of add2fs_from_dir.
+// 100 unused entries is the default; the larger counts are what
+// --cache-memory gives with budgets of a few MiB to a few hundred.
+
+#include <config.h>
+
+#include "bench.h"
+
+double cache_workload_new(unsigned int ops, unsigned int max_free);
+double cache_workload_old(unsigned int ops, unsigned int max_free);
+
+#define OPS 2000000
+
+int
+main(void)
+{
+	static const unsigned int max_free[] = { 100, 1000, 10000, 100000 };
+	unsigned int i;
+
+	printf("%-16s %14s %14s %8s\n", "unused entries",
+	       "chained ns/op", "open ns/op", "speedup");
+	for (i = 0; i < sizeof(max_free) / sizeof(max_free[0]); i++) {
+		double old = cache_workload_old(OPS, max_free[i]);
+		double new = cache_workload_new(OPS, max_free[i]);
+
+		printf("%-16u %14.1f %14.1f %7.1fx\n", max_free[i],
+		       old, new, old / new);
+	}
+	return 0;
+}
@@ -0,0 +1,18 @@
+/* vi: set sw=8 ts=8: */
+// cache_new.c
+//
+// ext2 filesystem generator for embedded systems
+//
+// Please direct support requests to https://github.com/bestouff/genext2fs/issues
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; version
+// 2 of the License.
+
+#include <config.h>
+
+#include "cache.h"
+
+#define CACHE_WORKLOAD cache_workload_new
+#include "cache_workload.h"
@@ -0,0 +1,96 @@
+/* vi: set sw=8 ts=8: */
+// cache_workload.h
+//
+// ext2 filesystem generator for embedded systems
+//
+// Please direct support requests to https://github.com/bestouff/genext2fs/issues
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; version
+// 2 of the License.
+
+// The get/put pattern of add2fs_from_dir on the block cache, written
+// against the listcache interface.  cache_new.c and cache_old.c
+// include it after their own cache.h, with CACHE_WORKLOAD naming the
+// function.
+//
+// Half the accesses are fresh data blocks, in increasing order, as
+// files are written.  A third go to a small hot set (inode tables,
+// bitmaps, the directory being filled), and the rest to one of the
+// last 2048 data blocks (block maps, directories being extended).
+
+#include "bench.h"
+
+#define HOT_BLOCKS 64
+#define WARM_BLOCKS 2048
+
+typedef struct
+{
+	cache_link link;
+	unsigned int blk;
+	int cached;
+} bench_item;
+
+static bench_item *bench_items;
+
+static unsigned int
+bench_elem_val(cache_link *elem)
+{
+	return container_of(elem, bench_item, link)->blk;
+}
+
+static void
+bench_freed(cache_link *elem)
+{
+	container_of(elem, bench_item, link)->cached = 0;
+}
+
+// Run ops accesses with max_free unused entries kept, returns the
+// time per access in nanoseconds.
+double
+CACHE_WORKLOAD(unsigned int ops, unsigned int max_free)
+{
+	listcache c;
+	unsigned long long seed = 1;
+	unsigned int i, r, blk, next = HOT_BLOCKS;
+	unsigned long found = 0;
+	cache_link *l;
+	double t;
+
+	bench_items = calloc(HOT_BLOCKS + ops, sizeof(*bench_items));
+	if (!bench_items) {
+		perror("cache_bench");
+		exit(1);
+	}
+	(void) cache_init(&c, max_free, bench_elem_val, bench_freed);
+	t = bench_now();
+	for (i = 0; i < ops; i++) {
+		r = bench_rand(&seed) % 6;
+		if (r < 3 || next == HOT_BLOCKS)
+			blk = next++;
+		else if (r < 5)
+			blk = bench_rand(&seed) % HOT_BLOCKS;
+		else
+			blk = next - 1 - bench_rand(&seed) % (next - HOT_BLOCKS < WARM_BLOCKS
+						      ? next - HOT_BLOCKS : WARM_BLOCKS);
+		l = cache_find(&c, blk);
+		if (l)
+			found++;
+		else {
+			bench_items[blk].blk = blk;
+			bench_items[blk].cached = 1;
+			l = &bench_items[blk].link;
+			(void) cache_add(&c, l);
+		}
+		cache_item_set_unused(&c, l);
+	}
+	t = bench_now() - t;
+	(void) cache_flush(&c);
+#ifdef CACHE_MIN_SLOTS
+	cache_fini(&c);
+#endif
+	bench_sink += found;
+	free(bench_items);
+	return t * 1e9 / ops;
+}
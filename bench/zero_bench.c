@@ -0,0 +1,151 @@
+/* vi: set sw=8 ts=8: */
+// zero_bench.c
+//
+// ext2 filesystem generator for embedded systems
+//
+// Please direct support requests to https://github.com/bestouff/genext2fs/issues
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; version
+// 2 of the License.
+
+// Compares the zero block detection of bitops.h, used by -z, with the
+// is_blk_empty it replaced, a byte loop and bitops.h without its SSE2
+// path:
+//
+//  - a block of zeros, which has to be read to the end;
+//  - a block of data, which stops at its first byte;
+//  - a 64 block batch of extend_inode_blk with every other block
+//    zeros, one is_blk_empty per block against one blks_empty.
+
+#include <config.h>
+
+#include "bench.h"
+#include "bitops.h"
+
+#include "bitops_portable.h"
+
+#define BATCH 64
+#define MAX_BS 4096
+
+// is_blk_empty before bitops.h
+static int
+old_is_empty(const unsigned char *b, size_t bs)
+{
+	const unsigned int *v = (const unsigned int *) b;
+	size_t i;
+
+	for (i = 0; i < bs / 4; i++)
+		if (*v++)
+			return 0;
+	return 1;
+}
+
+static int
+byte_is_empty(const unsigned char *b, size_t bs)
+{
+	size_t i;
+
+	for (i = 0; i < bs; i++)
+		if (b[i])
+			return 0;
+	return 1;
+}
+
+static int
+word_is_empty(const unsigned char *b, size_t bs)
+{
+	return first_nonzero(b, bs) == bs;
+}
+
+static int
+portable_is_empty(const unsigned char *b, size_t bs)
+{
+	return first_nonzero_portable(b, bs) == bs;
+}
+
+#define TIME(res, reps, expr) do { \
+	unsigned int r_; \
+	double t_ = bench_now(); \
+	for (r_ = 0; r_ < (reps); r_++) { \
+		bench_sink += (expr); \
+		__asm__ __volatile__("" : : : "memory"); \
+	} \
+	(res) = (bench_now() - t_) * 1e9 / (reps); \
+} while (0)
+
+static unsigned char buf[BATCH * MAX_BS] __attribute__((aligned(64)));
+
+static void
+bench_block(const char *name, size_t bs)
+{
+	double old, byte, portable, word;
+
+	TIME(old, 200000, old_is_empty(buf, bs));
+	TIME(byte, 200000, byte_is_empty(buf, bs));
+	TIME(portable, 200000, portable_is_empty(buf, bs));
+	TIME(word, 200000, word_is_empty(buf, bs));
+	printf("%-22s %5zu %9.1f %9.1f %9.1f %9.1f %7.1fx\n", name, bs,
+	       old, byte, portable, word, old / word);
+}
+
+static unsigned int
+old_batch(size_t bs, unsigned char *empty)
+{
+	unsigned int i;
+
+	for (i = 0; i < BATCH; i++)
+		empty[i] = old_is_empty(buf + i * bs, bs);
+	return empty[BATCH - 1];
+}
+
+static unsigned int
+new_batch(size_t bs, unsigned char *empty)
+{
+	blks_empty(buf, BATCH, bs, empty);
+	return empty[BATCH - 1];
+}
+
+static void
+bench_batch(size_t bs)
+{
+	unsigned char e1[BATCH], e2[BATCH];
+	unsigned long long seed = 1;
+	unsigned int i;
+	double old, word;
+
+	memset(buf, 0, BATCH * bs);
+	for (i = 1; i < BATCH; i += 2)
+		buf[i * bs + bench_rand(&seed) % bs] = 1;
+	old_batch(bs, e1);
+	new_batch(bs, e2);
+	if (memcmp(e1, e2, BATCH)) {
+		fprintf(stderr, "zero_bench: blks_empty disagrees with is_blk_empty\n");
+		exit(1);
+	}
+	TIME(old, 5000, old_batch(bs, e1));
+	TIME(word, 5000, new_batch(bs, e2));
+	printf("%-22s %5zu %9.1f %9s %9s %9.1f %7.1fx\n", "batch of 64, half zero",
+	       bs, old, "-", "-", word, old / word);
+}
+
+int
+main(void)
+{
+	static const size_t bs[] = { 1024, 4096 };
+	unsigned long long seed = 1;
+	unsigned int i, j;
+
+	printf("%-22s %5s %9s %9s %9s %9s %8s\n", "ns/op", "bytes",
+	       "old", "byte", "portable", "bitops.h", "speedup");
+	for (i = 0; i < sizeof(bs) / sizeof(bs[0]); i++) {
+		memset(buf, 0, bs[i]);
+		bench_block("zero block", bs[i]);
+		for (j = 0; j < bs[i]; j++)
+			buf[j] = bench_rand(&seed) | 1;
+		bench_block("data block", bs[i]);
+		bench_batch(bs[i]);
+	}
+	return 0;
+}
@@ -0,0 +1,199 @@
+/* vi: set sw=8 ts=8: */
+// bitops.h
+//
+// ext2 filesystem generator for embedded systems
+//
+// Please direct support requests to https://github.com/bestouff/genext2fs/issues
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; version
+// 2 of the License.
+
+#ifndef __BITOPS_H__
+#define __BITOPS_H__
+
+#if HAVE_STRING_H
+# include <string.h>
+#endif
+#include <stddef.h>
+
+/* Scanning helpers for the block and inode bitmaps and for data
+ * blocks, shared with the micro-benchmarks in bench/.
+ *
+ * Words are loaded with memcpy, so buffers need no particular
+ * alignment.  When the compiler targets SSE2, as it always does on
+ * x86-64, bitmaps are scanned 32 bytes per step with it and data
+ * blocks are checked 64 bytes per step.  Defining BITOPS_NO_SIMD
+ * before including this file keeps to the portable code; "make bench"
+ * compares the two with the loops they replaced. */
+
+#if defined(__SSE2__) && !defined(BITOPS_NO_SIMD)
+# define BITOPS_SSE2 1
+# include <emmintrin.h>
+#endif
+
+/* Bitmap helpers.  Bits are numbered from 0 and ranges are [start,
+ * end).  Whole bytes and 64-bit words, or 32 bytes with SSE2, are
+ * skipped at once; they are only compared against all zeros or all
+ * ones, so the host byte order doesn't matter. */
+
+/* first bit in the range that is set (or clear if !set), end if none */
+static inline unsigned int
+bitmap_scan(const unsigned char *b, unsigned int start, unsigned int end, int set)
+{
+	unsigned char skip = set ? 0 : (unsigned char)-1;
+	unsigned long long wskip = set ? 0 : (unsigned long long)-1;
+	unsigned long long w;
+	unsigned int i = start;
+
+	while (i < end && i % 8) {
+		if (((b[i / 8] >> (i % 8)) & 1) == set)
+			return i;
+		i++;
+	}
+	while (i + 8 <= end && (i / 8) % sizeof(w) && b[i / 8] == skip)
+		i += 8;
+	if (!((i / 8) % sizeof(w))) {
+#if BITOPS_SSE2
+		const __m128i vskip = _mm_set1_epi8((char) skip);
+		__m128i v;
+
+		/* the words finish the last step and find the byte */
+		while (i + 256 <= end) {
+			v = _mm_and_si128(
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (b + i / 8)), vskip),
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (b + i / 8 + 16)), vskip));
+			if (_mm_movemask_epi8(v) != 0xffff)
+				break;
+			i += 256;
+		}
+#endif
+		while (i + 64 <= end) {
+			memcpy(&w, b + i / 8, sizeof(w));
+			if (w != wskip)
+				break;
+			i += 64;
+		}
+	}
+	while (i + 8 <= end && b[i / 8] == skip)
+		i += 8;
+	while (i < end && ((b[i / 8] >> (i % 8)) & 1) != set)
+		i++;
+	return i;
+}
+
+static inline unsigned int
+bitmap_find_zero(const unsigned char *b, unsigned int start, unsigned int end)
+{
+	return bitmap_scan(b, start, end, 0);
+}
+
+static inline unsigned int
+bitmap_find_set(const unsigned char *b, unsigned int start, unsigned int end)
+{
+	return bitmap_scan(b, start, end, 1);
+}
+
+/* first bit of the first run of n clear bits in the range, end if none */
+static inline unsigned int
+bitmap_find_zero_run(const unsigned char *b, unsigned int start, unsigned int end,
+		     unsigned int n)
+{
+	unsigned int i = start, j;
+
+	while ((i = bitmap_find_zero(b, i, end)) < end) {
+		if (n > end - i)
+			break;
+		j = bitmap_find_set(b, i, i + n);
+		if (j == i + n)
+			return i;
+		i = j;
+	}
+	return end;
+}
+
+/* set or clear all the bits in the range */
+static inline void
+bitmap_fill(unsigned char *b, unsigned int start, unsigned int end, int set)
+{
+	unsigned int i = start;
+
+	for (; i < end && i % 8; i++)
+		if (set)
+			b[i / 8] |= 1 << (i % 8);
+		else
+			b[i / 8] &= ~(1 << (i % 8));
+	if (end - i >= 8) {
+		memset(b + i / 8, set ? 0xff : 0, (end - i) / 8);
+		i += (end - i) & ~7;
+	}
+	for (; i < end; i++)
+		if (set)
+			b[i / 8] |= 1 << (i % 8);
+		else
+			b[i / 8] &= ~(1 << (i % 8));
+}
+
+/* Offset of the first non-zero byte of the len bytes at b, len if they
+ * are all zeros.  64 bytes are checked per step, as four SSE2 vectors or
+ * four 64-bit words, then the byte is looked for in the step that
+ * stopped the loop, or in the tail. */
+static inline size_t
+first_nonzero(const unsigned char *b, size_t len)
+{
+	size_t i = 0;
+#if BITOPS_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v;
+#else
+	unsigned long long w[8];
+#endif
+
+	/* most blocks of data don't even start with a zero */
+	if (len && b[0])
+		return 0;
+#if BITOPS_SSE2
+	for (; i + 64 <= len; i += 64) {
+		v = _mm_or_si128(
+			_mm_or_si128(_mm_loadu_si128((const __m128i *) (b + i)),
+				     _mm_loadu_si128((const __m128i *) (b + i + 16))),
+			_mm_or_si128(_mm_loadu_si128((const __m128i *) (b + i + 32)),
+				     _mm_loadu_si128((const __m128i *) (b + i + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff)
+			break;
+	}
+#else
+	for (; i + sizeof(w) <= len; i += sizeof(w)) {
+		memcpy(w, b + i, sizeof(w));
+		if (w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7])
+			break;
+	}
+#endif
+	for (; i < len && !b[i]; i++)
+		;
+	return i;
+}
+
+/* Sets empty[i] for each of the count blocks of bs bytes at b that is
+ * all zeros, in one pass: a run of zeros is scanned in one go whatever
+ * the number of blocks it covers, and a block of data is left at its
+ * first non-zero byte. */
+static inline void
+blks_empty(const unsigned char *b, unsigned int count, size_t bs,
+	   unsigned char *empty)
+{
+	size_t len = count * bs, pos = 0, nz;
+
+	while (pos < len) {
+		nz = pos + first_nonzero(b + pos, len - pos);
+		for (; pos + bs <= nz; pos += bs)
+			empty[pos / bs] = 1;
+		if (pos < len) {
+			empty[pos / bs] = 0;
+			pos += bs;
+		}
+	}
+}
+
+#endif /* __BITOPS_H__ */
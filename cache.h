@@ -19,14 +19,28 @@
 
 #include "list.h"
 
-#define CACHE_LISTS 256
+/* Items are found through an open addressing hash table with linear
+ * probing.  Each slot holds the key next to the item pointer, so a
+ * lookup only touches consecutive slots until it hits the key or an
+ * empty slot.  The table doubles whenever it gets half full.
+ *
+ * With the default of 100 unused items nearly every add evicts one,
+ * and a table 40% full spends that on probing and on moving items
+ * back in cache_remove_slot: start at 16 KiB, about 10% full there. */
+
+#define CACHE_MIN_SLOTS 1024
 
 typedef struct
 {
-    list_elem link;
     list_elem lru_link;
 } cache_link;
 
+typedef struct
+{
+    unsigned int key;
+    cache_link *elem;    /* NULL for an empty slot */
+} cache_slot;
+
 typedef struct
 {
     /* LRU list holds unused items */
@@ -35,37 +49,148 @@ typedef struct
     unsigned int max_free_entries;
 
     unsigned int entries;
-    list_elem lists[CACHE_LISTS];
+    unsigned int mask;   /* number of slots - 1 */
+    unsigned int shift;  /* 32 - log2(number of slots) */
+    cache_slot *slots;
     unsigned int (*elem_val)(cache_link *elem);
     void (*freed)(cache_link *elem);
+    /* Optional, releases several items at once */
+    void (*freed_batch)(cache_link **elems, unsigned int count);
+
+    unsigned long hits;
+    unsigned long misses;
 } listcache;
 
+/* Keys are block and inode numbers, which come in runs: spread them
+ * with a multiplicative hash. */
+static inline unsigned int
+cache_hash(listcache *c, unsigned int val)
+{
+    return (unsigned int) (val * 2654435769u) >> c->shift;
+}
+
+static inline cache_slot *
+cache_lookup(listcache *c, unsigned int val)
+{
+    unsigned int i = cache_hash(c, val);
+
+    while (c->slots[i].elem) {
+        if (c->slots[i].key == val)
+            return &c->slots[i];
+        i = (i + 1) & c->mask;
+    }
+    return NULL;
+}
+
+static inline void
+cache_insert_slot(listcache *c, unsigned int val, cache_link *elem)
+{
+    unsigned int i = cache_hash(c, val);
+
+    while (c->slots[i].elem)
+        i = (i + 1) & c->mask;
+    c->slots[i].key = val;
+    c->slots[i].elem = elem;
+}
+
+/* Empty a slot, and move back the following items of the same probe
+ * sequence so that lookups never stop early. */
+static inline void
+cache_remove_slot(listcache *c, cache_slot *slot)
+{
+    unsigned int i = slot - c->slots, j = i, home;
+
+    for (;;) {
+        c->slots[i].elem = NULL;
+        for (;;) {
+            j = (j + 1) & c->mask;
+            if (!c->slots[j].elem)
+                return;
+            home = cache_hash(c, c->slots[j].key);
+            /* can the item at j live at i ? */
+            if (i <= j ? (home <= i || home > j) : (home <= i && home > j))
+                break;
+        }
+        c->slots[i] = c->slots[j];
+        i = j;
+    }
+}
+
+static inline int
+cache_resize(listcache *c, unsigned int nslots)
+{
+    cache_slot *old = c->slots;
+    unsigned int i, oldn = old ? c->mask + 1 : 0;
+
+    c->slots = calloc(nslots, sizeof(*c->slots));
+    if (!c->slots) {
+        c->slots = old;
+        return -1;
+    }
+    c->mask = nslots - 1;
+    for (c->shift = 32; nslots > 1; nslots >>= 1)
+        c->shift--;
+    for (i = 0; i < oldn; i++)
+        if (old[i].elem)
+            cache_insert_slot(c, old[i].key, old[i].elem);
+    free(old);
+    return 0;
+}
+
+/* Unlink an unused item, from both the table and the LRU list */
 static inline void
+cache_unlink(listcache *c, cache_link *l)
+{
+    list_del(&l->lru_link);
+    cache_remove_slot(c, cache_lookup(c, c->elem_val(l)));
+    c->entries--;
+    c->lru_entries--;
+}
+
+/* Add an item, returns non-zero if memory runs out */
+static inline int
 cache_add(listcache *c, cache_link *elem)
 {
-    unsigned int hash = c->elem_val(elem) % CACHE_LISTS;
     int delcount = c->lru_entries - c->max_free_entries;
 
     if (delcount > 0) {
-        /* Delete some unused items. */
+        /* Delete some unused items.  With a batch release, evict
+         * half of the allowed unused items as well so that they go
+         * out together. */
         list_elem *lru, *next;
-        cache_link *l;
+        cache_link *l, **batch = NULL;
+        unsigned int count = 0;
+
+        if (c->freed_batch) {
+            delcount += c->max_free_entries / 2;
+            batch = malloc(delcount * sizeof(*batch));
+        }
         list_for_each_elem_safe(&c->lru_list, lru, next) {
             l = container_of(lru, cache_link, lru_link);
-            list_del(lru);
-            list_del(&l->link);
-            c->entries--;
-            c->lru_entries--;
-            c->freed(l);
+            cache_unlink(c, l);
+            if (batch)
+                batch[count++] = l;
+            else
+                c->freed(l);
             delcount--;
             if (delcount <= 0)
                 break;
         }
+        if (batch) {
+            c->freed_batch(batch, count);
+            free(batch);
+        }
     }
 
+    /* Grow at half load; if that fails, carry on until full. */
+    if ((c->entries + 1) * 2 > c->mask + 1
+        && cache_resize(c, (c->mask + 1) * 2)
+        && c->entries + 1 > c->mask)
+        return -1;
     c->entries++;
     list_item_init(&elem->lru_link); /* Mark it not in the LRU list */
-    list_add_after(&c->lists[hash], &elem->link);
+    cache_insert_slot(c, c->elem_val(elem), elem);
+    return 0;
 }
 
 static inline void
@@ -78,67 +203,94 @@ cache_item_set_unused(listcache *c, cache_link *elem)
 static inline cache_link *
 cache_find(listcache *c, unsigned int val)
 {
-    unsigned int hash = val % CACHE_LISTS;
-    list_elem *elem;
-
-    list_for_each_elem(&c->lists[hash], elem) {
-        cache_link *l = container_of(elem, cache_link, link);
-        if (c->elem_val(l) == val) {
-            if (!list_empty(&l->lru_link)) {
-                /* It's in the unused list, remove it. */
-                list_del(&l->lru_link);
-                list_item_init(&l->lru_link);
-                c->lru_entries--;
-            }
-            return l;
-        }
+    cache_slot *slot = cache_lookup(c, val);
+    cache_link *l;
+
+    if (!slot) {
+        c->misses++;
+        return NULL;
     }
-    return NULL;
+    c->hits++;
+    l = slot->elem;
+    if (!list_empty(&l->lru_link)) {
+        /* It's in the unused list, remove it. */
+        list_del(&l->lru_link);
+        list_item_init(&l->lru_link);
+        c->lru_entries--;
+    }
+    return l;
 }
 
 static inline int
 cache_flush(listcache *c)
 {
     list_elem *elem, *next;
-    cache_link *l;
-    int i;
+    cache_link *l, **batch = NULL;
+    unsigned int count = 0;
+    unsigned int i;
+
+    if (c->freed_batch && c->entries)
+        batch = malloc(c->entries * sizeof(*batch));
 
+    /* Empty the LRU list, then release everything from the table */
     list_for_each_elem_safe(&c->lru_list, elem, next) {
         l = container_of(elem, cache_link, lru_link);
         list_del(elem);
-        list_del(&l->link);
-        c->entries--;
+        list_item_init(elem);
         c->lru_entries--;
-        c->freed(l);
     }
 
-    for (i = 0; i < CACHE_LISTS; i++) {
-        list_for_each_elem_safe(&c->lists[i], elem, next) {
-            l = container_of(elem, cache_link, link);
-            list_del(&l->link);
-            c->entries--;
+    for (i = 0; i <= c->mask; i++) {
+        l = c->slots[i].elem;
+        if (!l)
+            continue;
+        c->slots[i].elem = NULL;
+        c->entries--;
+        if (batch)
+            batch[count++] = l;
+        else
             c->freed(l);
-        }
+    }
+
+    if (batch) {
+        c->freed_batch(batch, count);
+        free(batch);
     }
 
     return c->entries || c->lru_entries;
 }
 
-static inline void
+static inline int
 cache_init(listcache *c, unsigned int max_free_entries,
        unsigned int (*elem_val)(cache_link *elem),
        void (*freed)(cache_link *elem))
 {
-    int i;
-
     c->entries = 0;
     c->lru_entries = 0;
     c->max_free_entries = max_free_entries;
     list_init(&c->lru_list);
-    for (i = 0; i < CACHE_LISTS; i++)
-        list_init(&c->lists[i]);
+    c->slots = NULL;
     c->elem_val = elem_val;
     c->freed = freed;
+    c->freed_batch = NULL;
+    c->hits = 0;
+    c->misses = 0;
+    return cache_resize(c, CACHE_MIN_SLOTS);
+}
+
+static inline void
+cache_fini(listcache *c)
+{
+    free(c->slots);
+    c->slots = NULL;
+}
+
+/* Let the cache release evicted and flushed items in batches */
+static inline void
+cache_set_batch(listcache *c,
+       void (*freed_batch)(cache_link **elems, unsigned int count))
+{
+    c->freed_batch = freed_batch;
 }
 
 #endif /* __CACHE_H__ */
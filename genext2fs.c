@@ -148,6 +148,14 @@
 # include <limits.h>
 #endif
 
+#if HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+
+#if HAVE_SYS_UIO_H
+# include <sys/uio.h>
+#endif
+
 #ifdef HAVE_LIBARCHIVE
 #include <archive.h>
 #include <archive_entry.h>
@@ -158,7 +166,13 @@
 #include <sys/xattr.h>
 #endif
 
+#if HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+#include "bitops.h"
 #include "cache.h"
+#include "pool.h"
 
 #define MIN(a, b) ((a) > (b) ? (b) : (a))
 
@@ -166,9 +180,12 @@
 #define FSLAYER_TABLE 1
 #define FSLAYER_TAR   2
 
+struct srcdir;
+
 struct fslayer {
 	int type;
 	char * path;
+	struct srcdir *manifest; // what the sizing pass read of a directory
 };
 
 #define TAR_BLOCKSIZE 512
@@ -206,11 +223,17 @@ typedef signed short int16;
 typedef unsigned short uint16;
 typedef signed int int32;
 typedef unsigned int uint32;
+typedef unsigned long long uint64;
 
 // block size
 
 static uint32 blocksize = 1024;
 
+// map regular file output images into memory instead of going
+// through stdio for every block (see --no-mmap)
+
+static int use_mmap = 1;
+
 #define SUPERBLOCK_OFFSET	1024
 #define SUPERBLOCK_SIZE		1024
 
@@ -331,11 +354,11 @@ static uint32 blocksize = 1024;
 	  (fs)->sb->s_blocks_per_group - 1) / (fs)->sb->s_blocks_per_group)
 
 // Get group block bitmap (bbm) given the group number
-#define GRP_GET_GROUP_BBM(fs,grp,bi) (get_blk((fs),(grp)->bg_block_bitmap,(bi)))
+#define GRP_GET_GROUP_BBM(fs,grp,bi) (get_group_bbm((fs),(grp),(bi)))
 #define GRP_PUT_GROUP_BBM(bi) ( put_blk((bi)) )
 
 // Get group inode bitmap (ibm) given the group number
-#define GRP_GET_GROUP_IBM(fs,grp,bi) (get_blk((fs), (grp)->bg_inode_bitmap,(bi)))
+#define GRP_GET_GROUP_IBM(fs,grp,bi) (get_group_ibm((fs),(grp),(bi)))
 #define GRP_PUT_GROUP_IBM(bi) ( put_blk((bi)) )
 
 // Given an inode number find the group it belongs to
@@ -540,13 +563,7 @@ swab32(uint32 val)
 static inline int
 is_blk_empty(uint8 *b)
 {
-	uint32 i;
-	uint32 *v = (uint32 *) b;
-
-	for(i = 0; i < BLOCKSIZE / 4; i++)
-		if (*v++)
-			return 0;
-	return 1;
+	return first_nonzero(b, BLOCKSIZE) == BLOCKSIZE;
 }
 
 // on-disk structures
@@ -589,13 +606,37 @@ is_blk_empty(uint8 *b)
 	utdecl8(s_uuid,16)		/* 128-bit uuid for volume */	\
 	utdecl8(s_volume_name,16) 	/* volume name */		\
 	utdecl8(s_last_mounted,64) 	/* directory where last mounted */ \
-	udecl32(s_algorithm_usage_bitmap) /* For compression */
+	udecl32(s_algorithm_usage_bitmap) /* For compression */ \
+	udecl8(s_prealloc_blocks)	/* Nr of blocks to try to preallocate */ \
+	udecl8(s_prealloc_dir_blocks)	/* Nr to preallocate for dirs */ \
+	udecl16(s_reserved_gdt_blocks)	/* Per group table for online growth */ \
+	utdecl8(s_journal_uuid,16)	/* uuid of journal superblock */ \
+	udecl32(s_journal_inum)		/* inode number of journal file */ \
+	udecl32(s_journal_dev)		/* device number of journal file */ \
+	udecl32(s_last_orphan)		/* start of list of inodes to delete */ \
+	utdecl32(s_hash_seed,4)		/* HTREE hash seed */ \
+	udecl8(s_def_hash_version)	/* Default hash version to use */ \
+	udecl8(s_jnl_backup_type)	/* Default type of journal backup */ \
+	udecl16(s_desc_size)		/* Group desc. size: INCOMPAT_64BIT */ \
+	udecl32(s_default_mount_opts)	/* default mount options */ \
+	udecl32(s_first_meta_bg)	/* First metablock group */ \
+	udecl32(s_mkfs_time)		/* When the filesystem was created */ \
+	utdecl32(s_jnl_blocks,17)	/* Backup of the journal inode */ \
+	udecl32(s_blocks_count_hi)	/* Blocks count high 32bits */ \
+	udecl32(s_r_blocks_count_hi)	/* Reserved blocks with high 32 bits*/ \
+	udecl32(s_free_blocks_hi)	/* Free blocks count */ \
+	udecl16(s_min_extra_isize)	/* All inodes have at least # bytes */ \
+	udecl16(s_want_extra_isize)	/* New inodes should reserve # bytes */ \
+	udecl32(s_flags)		/* Miscellaneous flags */
 
 #define EXT2_GOOD_OLD_FIRST_INO	11
 #define EXT2_GOOD_OLD_INODE_SIZE 128
 #define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER	0x0001
 #define EXT2_FEATURE_RO_COMPAT_LARGE_FILE	0x0002
 #define EXT2_FEATURE_COMPAT_EXT_ATTR		0x0008
+#define EXT2_FEATURE_COMPAT_DIR_INDEX		0x0020
+#define EXT2_FLAGS_UNSIGNED_HASH		0x0002
+#define EXT2_INDEX_FL				0x00001000
 
 // extended attributes on-disk structures
 
@@ -683,7 +724,7 @@ struct ext2_xattr_entry {
 typedef struct
 {
 	superblock_decl
-	uint32 s_reserved[205];       // Reserved
+	uint32 s_reserved[167];       // Reserved
 } superblock;
 
 typedef struct
@@ -740,26 +781,61 @@ typedef struct
 	uint32 bptind;
 } blockwalker;
 
-#define HDLINK_CNT   16
+// Source files with more than one link that were already copied,
+// in an open addressed table on (st_dev, st_ino).  A dst_nod of 0
+// marks a free slot.
+#define HDLINK_CNT   64
 struct hdlink_s
 {
-	uint32	src_inode;
+	dev_t	src_dev;
+	ino_t	src_inode;
 	uint32	dst_nod;
 };
 
 struct hdlinks_s
 {
 	int32 count;
+	uint32 mask;
 	struct hdlink_s *hdl;
+	unsigned long links;     // entries made as links to them
 };
 
+struct blk_info_s;
+struct nod_info_s;
+struct dirindex_s;
+struct pathcache_s;
+
+// Free block and inode counts of every group, with a tree over the
+// groups that gives the one alloc_nod picks in O(1).  Each node holds
+// the eligible group with the most free blocks in its range, the lower
+// one on a tie.  Eligibility depends on the average number of free
+// inodes, so the tree is rebuilt whenever that average changes.
+// first_free is where alloc_blk starts looking once the home group of
+// an inode is full.
+typedef struct
+{
+	uint32 ngroups;
+	uint32 nleaves;          // power of two >= ngroups
+	uint32 avefreei;         // average the tree was built for
+	uint32 *free_blocks;
+	uint32 *free_inodes;
+	uint32 *tree;            // 2 * nleaves nodes, root at 1
+	uint32 first_free;       // no group below this one has free blocks
+	unsigned long rebuilds;
+	unsigned long fallbacks;      // alloc_blk calls that left the home group
+	unsigned long fallback_grps;  // groups they looked at
+} grpsummary;
+
 /* Filesystem structure that support groups */
 typedef struct
 {
 	FILE *f;
+	uint8 *map;              // whole image when mapped, NULL for stdio
+	size_t mapsize;
+	struct blk_info_s *map_bi; // shared block info for mapped blocks
+	int in_stdout;           // f is stdout itself, nothing to copy
 	superblock *sb;
 	int swapit;
-	int32 hdlink_cnt;
 	struct hdlinks_s hdlinks;
 
 	int holes;
@@ -769,8 +845,65 @@ typedef struct
 	listcache inodes;
 	listcache blkmaps;
 
+	// memory for the cache entries and block buffers
+	pool blk_pool;
+	pool buf_pool;           // BLOCKSIZE buffers, also used as work blocks
+	pool gd_pool;
+	pool blkmap_pool;
+	pool nod_pool;
+
+	// descriptors (in host byte order) and bitmaps of all the groups,
+	// when load_groups keeps them in memory, NULL otherwise
+	groupdescriptor *gdt;
+	uint8 *bbms;
+	uint8 *ibms;
+	struct blk_info_s *resident_bi; // shared block info for the bitmaps
+
 	uint32 *blk_alloc_hint;  // per-group byte offset hint for block bitmap scan
 	uint32 *ino_alloc_hint;  // per-group byte offset hint for inode bitmap scan
+	int reuse_freed_blks;    // free_blk moves blk_alloc_hint back
+	grpsummary grps;         // built by the first alloc_nod
+
+	struct nod_info_s **itbs; // inode table blocks in use or cached
+	uint32 itbs_per_group;
+
+	// name indexes of the larger directories, hashed on the inode
+	struct dirindex_s **dirindexes;
+	uint32 dirindex_mask;
+	uint32 ndirindexes;
+	unsigned long dirindex_builds;
+	unsigned long dirindex_lookups;
+	unsigned long dx_dirs;   // directories rewritten as htrees
+
+	// paths find_path resolved, hashed on the path and on their last
+	// component
+	struct pathcache_s **paths;
+	struct pathcache_s **pathcomps;
+	uint32 path_mask;
+	uint32 npaths;
+	unsigned long path_hits;
+	unsigned long path_misses;
+	unsigned long path_flushes;
+
+	int no_copy_range;       // copy_file_range failed, don't try again
+	unsigned long long copy_range_bytes;
+
+	unsigned long prefetch_files;  // files copied from a read ahead
+	unsigned long long prefetch_bytes;
+
+	// blocks reserved by reserve_blks for the file being written
+	uint32 resv_nod;
+	uint32 resv_grp;
+	uint32 resv_next;        // next reserved block, as an index in the group
+	uint32 resv_left;
+	unsigned long resv_runs;
+	unsigned long resv_blocks;
+
+	unsigned long blk_reads;       // blocks read from the image
+	unsigned long blk_fresh;       // new blocks handed out without a read
+	unsigned long blk_writebacks;  // dirty blocks written to the image
+	unsigned long blk_writeruns;   // contiguous runs they were written in
+	unsigned long blk_clean_drops; // clean blocks dropped without a write
 } filesystem;
 
 // now the endianness swap
@@ -940,16 +1073,74 @@ xstrdup(const char *s)
 	return t;
 }
 
-int
-is_hardlink(filesystem *fs, ino_t inode)
+static inline uint32
+hdlink_hash(dev_t dev, ino_t inode)
 {
-	int i;
+	uint64 h = ((uint64) inode ^ ((uint64) dev << 32 | (uint64) dev >> 32))
+		* 0x9e3779b97f4a7c15ull;
+	return h >> 32;
+}
+
+static struct hdlink_s *
+hdlink_slot(struct hdlinks_s *hl, dev_t dev, ino_t inode)
+{
+	struct hdlink_s *h;
+	uint32 i;
 
-	for(i = 0; i < fs->hdlinks.count; i++) {
-		if(fs->hdlinks.hdl[i].src_inode == inode)
-			return i;
+	for (i = hdlink_hash(dev, inode) & hl->mask; ; i = (i + 1) & hl->mask) {
+		h = &hl->hdl[i];
+		if (!h->dst_nod || (h->src_inode == inode && h->src_dev == dev))
+			return h;
 	}
-	return -1;
+}
+
+static uint32
+hdlinks_get(struct hdlinks_s *hl, dev_t dev, ino_t inode)
+{
+	if (!hl->hdl)
+		return 0;
+	return hdlink_slot(hl, dev, inode)->dst_nod;
+}
+
+static void
+hdlinks_put(struct hdlinks_s *hl, dev_t dev, ino_t inode, uint32 nod)
+{
+	struct hdlink_s *h, *old;
+	uint32 i, omask;
+
+	if (!nod)
+		return;
+	// keep the table at most half full
+	if (!hl->hdl || (uint32) hl->count * 2 >= hl->mask) {
+		old = hl->hdl;
+		omask = hl->mask;
+		hl->mask = old ? omask * 2 + 1 : HDLINK_CNT - 1;
+		if (!(hl->hdl = calloc(hl->mask + 1, sizeof(*hl->hdl))))
+			error_msg_and_die("Not enough memory");
+		for (i = 0; old && i <= omask; i++)
+			if (old[i].dst_nod)
+				*hdlink_slot(hl, old[i].src_dev, old[i].src_inode) = old[i];
+		free(old);
+	}
+	h = hdlink_slot(hl, dev, inode);
+	if (!h->dst_nod)
+		hl->count++;
+	h->src_dev = dev;
+	h->src_inode = inode;
+	h->dst_nod = nod;
+}
+
+// the inode a source file was copied to, 0 if it was not seen yet
+uint32
+is_hardlink(filesystem *fs, dev_t dev, ino_t inode)
+{
+	return hdlinks_get(&fs->hdlinks, dev, inode);
+}
+
+static void
+add_hardlink(filesystem *fs, dev_t dev, ino_t inode, uint32 nod)
+{
+	hdlinks_put(&fs->hdlinks, dev, inode, nod);
 }
 
 // printf helper macro
@@ -957,17 +1148,18 @@ is_hardlink(filesystem *fs, ino_t inode)
 
 // temporary working block
 static inline uint8 *
-get_workblk(void)
+get_workblk(filesystem *fs)
 {
-	unsigned char* b=calloc(1,BLOCKSIZE);
+	unsigned char* b=pool_get(&fs->buf_pool);
 	if (!b)
 		error_msg_and_die("get_workblk() failed, out of memory");
+	memset(b, 0, BLOCKSIZE);
 	return b;
 }
 static inline void
-free_workblk(block b)
+free_workblk(filesystem *fs, block b)
 {
-	free(b);
+	pool_put(&fs->buf_pool, b);
 }
 
 /* Rounds qty upto a multiple of siz. siz should be a power of 2 */
@@ -986,7 +1178,7 @@ allocated(block b, uint32 item)
 
 // Used by get_blk/put_blk to hold information about a block owned
 // by the user.
-typedef struct
+typedef struct blk_info_s
 {
 	cache_link link;
 
@@ -994,10 +1186,99 @@ typedef struct
 	uint32 blk;
 	uint8 *b;
 	uint32 usecount;
+	int dirty;
 } blk_info;
 
 #define MAX_FREE_CACHE_BLOCKS 100
 
+// Read and write raw parts of the image, bypassing the block cache.
+// Once the image is set up, unmapped images are only accessed through
+// pread/pwrite on the descriptor so that stdio buffers never get stale.
+static void
+image_read(filesystem *fs, off_t pos, void *buf, size_t size, const char *what)
+{
+	uint8 *b = buf;
+	ssize_t n;
+
+	if (fs->map) {
+		memcpy(buf, fs->map + pos, size);
+		return;
+	}
+	while (size > 0) {
+		n = pread(fileno(fs->f), b, size, pos);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			perror_msg_and_die("read %s", what);
+		if (n == 0)
+			error_msg_and_die("read %s: unexpected end of image", what);
+		b += n;
+		pos += n;
+		size -= n;
+	}
+}
+
+static void
+image_write(filesystem *fs, off_t pos, const void *buf, size_t size, const char *what)
+{
+	const uint8 *b = buf;
+	ssize_t n;
+
+	if (fs->map) {
+		memcpy(fs->map + pos, buf, size);
+		return;
+	}
+	while (size > 0) {
+		n = pwrite(fileno(fs->f), b, size, pos);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			perror_msg_and_die("write %s", what);
+		b += n;
+		pos += n;
+		size -= n;
+	}
+}
+
+// Write cnt consecutive blocks starting at blk in a single call when
+// the platform allows it.
+#define WRITEBACK_IOV 64
+
+static void
+image_writev(filesystem *fs, uint32 blk, struct iovec *iov, int cnt)
+{
+	off_t pos = ((off_t) blk) * BLOCKSIZE;
+#if HAVE_PWRITEV
+	ssize_t n;
+
+	while (cnt > 0) {
+		n = pwritev(fileno(fs->f), iov, cnt, pos);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			perror_msg_and_die("write blocks");
+		pos += n;
+		// skip what was written, the rest is retried
+		while (cnt > 0 && (size_t) n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (uint8 *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+#else
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		image_write(fs, pos, iov[i].iov_base, iov[i].iov_len, "block");
+		pos += iov[i].iov_len;
+	}
+#endif
+}
+
 static uint32
 blk_elem_val(cache_link *elem)
 {
@@ -1010,18 +1291,71 @@ blk_freed(cache_link *elem)
 {
 	blk_info *bi = container_of(elem, blk_info, link);
 
-	if (fseeko(bi->fs->f, ((off_t) bi->blk) * BLOCKSIZE, SEEK_SET))
-		perror_msg_and_die("fseek");
-	if (fwrite(bi->b, BLOCKSIZE, 1, bi->fs->f) != 1)
-		perror_msg_and_die("get_blk: write");
-	free(bi->b);
-	free(bi);
+	if (!bi->dirty) {
+		// nothing changed since it was read, the image is up to date
+		bi->fs->blk_clean_drops++;
+		goto out;
+	}
+	image_write(bi->fs, ((off_t) bi->blk) * BLOCKSIZE, bi->b, BLOCKSIZE,
+		    "block");
+	bi->fs->blk_writebacks++;
+	bi->fs->blk_writeruns++;
+out:
+	pool_put(&bi->fs->buf_pool, bi->b);
+	pool_put(&bi->fs->blk_pool, bi);
+}
+
+static int
+blk_link_cmp(const void *a, const void *b)
+{
+	uint32 ba = container_of(*(cache_link **) a, blk_info, link)->blk;
+	uint32 bb = container_of(*(cache_link **) b, blk_info, link)->blk;
+
+	return (ba > bb) - (ba < bb);
+}
+
+// Write back a batch of blocks leaving the cache: sort them, and write
+// runs of adjacent dirty blocks with one call each.
+static void
+blk_freed_batch(cache_link **elems, unsigned int count)
+{
+	struct iovec iov[WRITEBACK_IOV];
+	filesystem *fs;
+	blk_info *bi, *first;
+	unsigned int i, j;
+	int n;
+
+	if (!count)
+		return;
+	fs = container_of(elems[0], blk_info, link)->fs;
+	qsort(elems, count, sizeof(*elems), blk_link_cmp);
+	for (i = 0; i < count; i = j) {
+		first = container_of(elems[i], blk_info, link);
+		if (!first->dirty) {
+			fs->blk_clean_drops++;
+			j = i + 1;
+			continue;
+		}
+		for (j = i, n = 0; j < count && n < WRITEBACK_IOV; j++, n++) {
+			bi = container_of(elems[j], blk_info, link);
+			if (!bi->dirty || bi->blk != first->blk + n)
+				break;
+			iov[n].iov_base = bi->b;
+			iov[n].iov_len = BLOCKSIZE;
+		}
+		image_writev(fs, first->blk, iov, n);
+		fs->blk_writebacks += n;
+		fs->blk_writeruns++;
+	}
+	for (i = 0; i < count; i++) {
+		bi = container_of(elems[i], blk_info, link);
+		pool_put(&fs->buf_pool, bi->b);
+		pool_put(&fs->blk_pool, bi);
+	}
 }
 
-// Return a given block from a filesystem.  Make sure to call
-// put_blk when you are done with it.
 static inline uint8 *
-get_blk(filesystem *fs, uint32 blk, blk_info **rbi)
+fetch_blk(filesystem *fs, uint32 blk, blk_info **rbi, int fresh)
 {
 	cache_link *curr;
 	blk_info *bi;
@@ -1029,29 +1363,36 @@ get_blk(filesystem *fs, uint32 blk, blk_info **rbi)
 	if (blk >= fs->sb->s_blocks_count)
 		error_msg_and_die("Internal error, block out of range");
 
+	if (fs->map) {
+		*rbi = fs->map_bi;
+		return fs->map + ((size_t) blk) * BLOCKSIZE;
+	}
+
 	curr = cache_find(&fs->blks, blk);
 	if (curr) {
 		bi = container_of(curr, blk_info, link);
 		bi->usecount++;
+		bi->dirty |= fresh;
 		goto out;
 	}
 
-	bi = malloc(sizeof(*bi));
+	bi = pool_get(&fs->blk_pool);
 	if (!bi)
 		error_msg_and_die("get_blk: out of memory");
 	bi->fs = fs;
 	bi->blk = blk;
 	bi->usecount = 1;
-	bi->b = malloc(BLOCKSIZE);
+	bi->dirty = fresh;
+	bi->b = pool_get(&fs->buf_pool);
 	if (!bi->b)
 		error_msg_and_die("get_blk: out of memory");
-	cache_add(&fs->blks, &bi->link);
-	if (fseeko(fs->f, ((off_t) blk) * BLOCKSIZE, SEEK_SET))
-		perror_msg_and_die("fseek");
-	if (fread(bi->b, BLOCKSIZE, 1, fs->f) != 1) {
-		if (ferror(fs->f))
-			perror_msg_and_die("fread");
-		memset(bi->b, 0, BLOCKSIZE);
+	if (cache_add(&fs->blks, &bi->link))
+		error_msg_and_die("get_blk: out of memory");
+	if (fresh) {
+		fs->blk_fresh++;
+	} else {
+		image_read(fs, ((off_t) blk) * BLOCKSIZE, bi->b, BLOCKSIZE, "block");
+		fs->blk_reads++;
 	}
 
 out:
@@ -1059,9 +1400,38 @@ out:
 	return bi->b;
 }
 
+// Return a given block from a filesystem.  Make sure to call
+// put_blk when you are done with it.  The block is only written back
+// to the image if mark_blk_dirty was called on it.  When the image
+// is mapped, the block points straight into the mapping and does not
+// go through the block cache.
+static inline uint8 *
+get_blk(filesystem *fs, uint32 blk, blk_info **rbi)
+{
+	return fetch_blk(fs, blk, rbi, 0);
+}
+
+// Same as get_blk, for a block that was just allocated and that the
+// caller is going to fill entirely: it isn't read from the image, its
+// contents are undefined, and it is already marked dirty.
+static inline uint8 *
+get_blk_new(filesystem *fs, uint32 blk, blk_info **rbi)
+{
+	return fetch_blk(fs, blk, rbi, 1);
+}
+
+// Flag a block returned by get_blk as modified.
+static inline void
+mark_blk_dirty(blk_info *bi)
+{
+	bi->dirty = 1;
+}
+
 static inline void
 put_blk(blk_info *bi)
 {
+	if (bi == bi->fs->map_bi || bi == bi->fs->resident_bi)
+		return;
 	if (bi->usecount == 0)
 		error_msg_and_die("Internal error: put_blk usecount zero");
 	bi->usecount--;
@@ -1098,7 +1468,7 @@ gd_freed(cache_link *elem)
 	if (gi->fs->swapit)
 		swap_gd(gi->gd);
 	put_blk(gi->bi);
-	free(gi);
+	pool_put(&gi->fs->gd_pool, gi);
 }
 
 #define GDS_START ((SUPERBLOCK_OFFSET + SUPERBLOCK_SIZE + BLOCKSIZE - 1) / BLOCKSIZE)
@@ -1112,6 +1482,10 @@ get_gd(filesystem *fs, uint32 no, gd_info **rgi)
 	gd_info *gi;
 	cache_link *curr;
 
+	if (fs->gdt) {
+		*rgi = NULL;
+		return fs->gdt + no;
+	}
 	curr = cache_find(&fs->gds, no);
 	if (curr) {
 		gi = container_of(curr, gd_info, link);
@@ -1119,7 +1493,7 @@ get_gd(filesystem *fs, uint32 no, gd_info **rgi)
 		goto out;
 	}
 
-	gi = malloc(sizeof(*gi));
+	gi = pool_get(&fs->gd_pool);
 	if (!gi)
 		error_msg_and_die("get_gd: out of memory");
 	gi->fs = fs;
@@ -1128,7 +1502,8 @@ get_gd(filesystem *fs, uint32 no, gd_info **rgi)
 	gdblk = GDS_START + (no / GDS_PER_BLOCK);
 	offset = no % GDS_PER_BLOCK;
 	gi->gd = ((groupdescriptor *) get_blk(fs, gdblk, &gi->bi)) + offset;
-	cache_add(&fs->gds, &gi->link);
+	if (cache_add(&fs->gds, &gi->link))
+		error_msg_and_die("get_gd: out of memory");
 	if (fs->swapit)
 		swap_gd(gi->gd);
  out:
@@ -1137,9 +1512,19 @@ get_gd(filesystem *fs, uint32 no, gd_info **rgi)
 	return gi->gd;
 }
 
+// resident descriptors (gi is NULL) are all written by store_groups
+static inline void
+mark_gd_dirty(gd_info *gi)
+{
+	if (gi)
+		mark_blk_dirty(gi->bi);
+}
+
 static inline void
 put_gd(gd_info *gi)
 {
+	if (!gi)
+		return;
 	if (gi->usecount == 0)
 		error_msg_and_die("Internal error: put_gd usecount zero");
 
@@ -1149,6 +1534,100 @@ put_gd(gd_info *gi)
 		cache_item_set_unused(&gi->fs->gds, &gi->link);
 }
 
+// Get the block or inode bitmap of a group, release it with put_blk
+static inline uint8 *
+get_group_bbm(filesystem *fs, groupdescriptor *gd, blk_info **rbi)
+{
+	if (fs->gdt) {
+		*rbi = fs->resident_bi;
+		return fs->bbms + (size_t) (gd - fs->gdt) * BLOCKSIZE;
+	}
+	return get_blk(fs, gd->bg_block_bitmap, rbi);
+}
+
+static inline uint8 *
+get_group_ibm(filesystem *fs, groupdescriptor *gd, blk_info **rbi)
+{
+	if (fs->gdt) {
+		*rbi = fs->resident_bi;
+		return fs->ibms + (size_t) (gd - fs->gdt) * BLOCKSIZE;
+	}
+	return get_blk(fs, gd->bg_inode_bitmap, rbi);
+}
+
+// The allocator keeps going back to the group descriptors and bitmaps,
+// which only take two blocks per group.  Unless that's more than
+// GROUPS_RESIDENT_MAX, load_groups copies them all in memory once the
+// image is set up, so that getting one is an array lookup rather than
+// a trip through the caches, and store_groups writes them back.
+#define GROUPS_RESIDENT_MAX (64 << 20)
+#define GROUPS_RESIDENT_SIZE(fs) \
+	((unsigned long long) GRP_NBGROUPS(fs) * (2 * BLOCKSIZE + sizeof(groupdescriptor)))
+
+static void
+load_groups(filesystem *fs)
+{
+	uint32 i, ngroups = GRP_NBGROUPS(fs);
+	groupdescriptor *gdt, *gd;
+	gd_info *gi;
+	blk_info *bi;
+
+	if (GROUPS_RESIDENT_SIZE(fs) > GROUPS_RESIDENT_MAX)
+		return;
+	gdt = malloc(ngroups * sizeof(*gdt));
+	fs->bbms = malloc((size_t) ngroups * BLOCKSIZE);
+	fs->ibms = malloc((size_t) ngroups * BLOCKSIZE);
+	fs->resident_bi = calloc(1, sizeof(*fs->resident_bi));
+	if (!gdt || !fs->bbms || !fs->ibms || !fs->resident_bi)
+		error_msg_and_die("load_groups: out of memory");
+	fs->resident_bi->fs = fs;
+	for (i = 0; i < ngroups; i++) {
+		gd = get_gd(fs, i, &gi);
+		gdt[i] = *gd;
+		memcpy(fs->bbms + (size_t) i * BLOCKSIZE,
+		       get_blk(fs, gd->bg_block_bitmap, &bi), BLOCKSIZE);
+		put_blk(bi);
+		memcpy(fs->ibms + (size_t) i * BLOCKSIZE,
+		       get_blk(fs, gd->bg_inode_bitmap, &bi), BLOCKSIZE);
+		put_blk(bi);
+		put_gd(gi);
+	}
+	if (cache_flush(&fs->gds))
+		error_msg_and_die("entry mismatch on gd cache flush");
+	// from now on get_gd and the bitmap macros use the copies
+	fs->gdt = gdt;
+}
+
+static void
+store_groups(filesystem *fs)
+{
+	uint32 i, ngroups = GRP_NBGROUPS(fs);
+	groupdescriptor *gd = NULL;
+	blk_info *gdbi = NULL, *bi;
+
+	if (!fs->gdt)
+		return;
+	for (i = 0; i < ngroups; i++) {
+		if (i % GDS_PER_BLOCK == 0) {
+			if (gdbi)
+				put_blk(gdbi);
+			gd = (groupdescriptor *) get_blk(fs, GDS_START + i / GDS_PER_BLOCK, &gdbi);
+			mark_blk_dirty(gdbi);
+		}
+		memcpy(get_blk_new(fs, fs->gdt[i].bg_block_bitmap, &bi),
+		       fs->bbms + (size_t) i * BLOCKSIZE, BLOCKSIZE);
+		put_blk(bi);
+		memcpy(get_blk_new(fs, fs->gdt[i].bg_inode_bitmap, &bi),
+		       fs->ibms + (size_t) i * BLOCKSIZE, BLOCKSIZE);
+		put_blk(bi);
+		gd[i % GDS_PER_BLOCK] = fs->gdt[i];
+		if (fs->swapit)
+			swap_gd(&gd[i % GDS_PER_BLOCK]);
+	}
+	if (gdbi)
+		put_blk(gdbi);
+}
+
 // Used by get_blkmap/put_blkmap to hold information about an block map
 // owned by the user.
 typedef struct
@@ -1179,13 +1658,13 @@ blkmap_freed(cache_link *elem)
 	if (bmi->fs->swapit)
 		swap_block(bmi->b);
 	put_blk(bmi->bi);
-	free(bmi);
+	pool_put(&bmi->fs->blkmap_pool, bmi);
 }
 
 // Return a given block map from a filesystem.  Make sure to call
 // put_blkmap when you are done with it.
 static inline uint32 *
-get_blkmap(filesystem *fs, uint32 blk, blkmap_info **rbmi)
+fetch_blkmap(filesystem *fs, uint32 blk, blkmap_info **rbmi, int fresh)
 {
 	blkmap_info *bmi;
 	cache_link *curr;
@@ -1194,25 +1673,55 @@ get_blkmap(filesystem *fs, uint32 blk, blkmap_info **rbmi)
 	if (curr) {
 		bmi = container_of(curr, blkmap_info, link);
 		bmi->usecount++;
+		if (fresh) {
+			memset(bmi->b, 0, BLOCKSIZE);
+			mark_blk_dirty(bmi->bi);
+		}
 		goto out;
 	}
 
-	bmi = malloc(sizeof(*bmi));
+	bmi = pool_get(&fs->blkmap_pool);
 	if (!bmi)
 		error_msg_and_die("get_blkmap: out of memory");
 	bmi->fs = fs;
 	bmi->blk = blk;
-	bmi->b = get_blk(fs, blk, &bmi->bi);
 	bmi->usecount = 1;
-	cache_add(&fs->blkmaps, &bmi->link);
-
-	if (fs->swapit)
-		swap_block(bmi->b);
+	if (fresh) {
+		// all zeroes reads the same in both byte orders
+		bmi->b = get_blk_new(fs, blk, &bmi->bi);
+		memset(bmi->b, 0, BLOCKSIZE);
+	} else {
+		bmi->b = get_blk(fs, blk, &bmi->bi);
+		if (fs->swapit)
+			swap_block(bmi->b);
+	}
+	if (cache_add(&fs->blkmaps, &bmi->link))
+		error_msg_and_die("get_blkmap: out of memory");
  out:
 	*rbmi = bmi;
 	return (uint32 *) bmi->b;
 }
 
+static inline uint32 *
+get_blkmap(filesystem *fs, uint32 blk, blkmap_info **rbmi)
+{
+	return fetch_blkmap(fs, blk, rbmi, 0);
+}
+
+// Return an empty block map for a block that was just allocated,
+// without reading it.
+static inline uint32 *
+get_blkmap_new(filesystem *fs, uint32 blk, blkmap_info **rbmi)
+{
+	return fetch_blkmap(fs, blk, rbmi, 1);
+}
+
+static inline void
+mark_blkmap_dirty(blkmap_info *bmi)
+{
+	mark_blk_dirty(bmi->bi);
+}
+
 static inline void
 put_blkmap(blkmap_info *bmi)
 {
@@ -1225,81 +1734,135 @@ put_blkmap(blkmap_info *bmi)
 		cache_item_set_unused(&bmi->fs->blkmaps, &bmi->link);
 }
 
-// Used by get_nod/put_nod to hold information about an inode owned
-// by the user.
-typedef struct
+// Used by get_nod/put_nod to hold a block of the inode tables while
+// inodes in it are in use.  Inode numbers are dense, so the blocks are
+// found straight in fs->itbs, indexed by group and position in the
+// group's table.  Unused blocks wait on the LRU list of fs->inodes,
+// whose hash table isn't used.
+typedef struct nod_info_s
 {
 	cache_link link;
 
 	filesystem *fs;
-	uint32 nod;
+	uint32 itb;              // index in fs->itbs
 	uint8 *b;
 	blk_info *bi;
-	inode *itab;
 	uint32 usecount;
 } nod_info;
 
 #define MAX_FREE_CACHE_INODES 100
 
+#define INODES_PER_BLOCK (BLOCKSIZE / sizeof(inode))
+
 static uint32
 inode_elem_val(cache_link *elem)
 {
 	nod_info *ni = container_of(elem, nod_info, link);
-	return ni->nod;
+	return ni->itb;
+}
+
+static void
+swap_itb(uint8 *b)
+{
+	uint32 i;
+
+	for (i = 0; i < INODES_PER_BLOCK; i++)
+		swap_nod(((inode *) b) + i);
 }
 
 static void
 inode_freed(cache_link *elem)
 {
 	nod_info *ni = container_of(elem, nod_info, link);
+	filesystem *fs = ni->fs;
 
-	if (ni->fs->swapit)
-		swap_nod(ni->itab);
+	if (fs->swapit)
+		swap_itb(ni->b);
+	fs->itbs[ni->itb] = NULL;
+	fs->inodes.entries--;
 	put_blk(ni->bi);
-	free(ni);
+	pool_put(&fs->nod_pool, ni);
 }
 
-#define INODES_PER_BLOCK (BLOCKSIZE / sizeof(inode))
+// Release the oldest unused inode table blocks until at most keep
+// are left.
+static void
+evict_itbs(filesystem *fs, unsigned int keep)
+{
+	listcache *c = &fs->inodes;
+	list_elem *lru, *next;
+
+	list_for_each_elem_safe(&c->lru_list, lru, next) {
+		if (c->lru_entries <= keep)
+			break;
+		list_del(lru);
+		c->lru_entries--;
+		inode_freed(container_of(lru, cache_link, lru_link));
+	}
+}
+
+static void
+init_itbs(filesystem *fs)
+{
+	fs->itbs_per_group = (fs->sb->s_inodes_per_group + INODES_PER_BLOCK - 1)
+		/ INODES_PER_BLOCK;
+	fs->itbs = calloc((size_t) GRP_NBGROUPS(fs) * fs->itbs_per_group,
+			  sizeof(*fs->itbs));
+	if (!fs->itbs)
+		error_msg_and_die("error allocating inode table index");
+}
 
 // Return a given inode from a filesystem.  Make sure to call
 // put_nod when you are done with it.
 static inline inode *
 get_nod(filesystem *fs, uint32 nod, nod_info **rni)
 {
-	uint32 grp, boffset, offset;
-	cache_link *curr;
+	uint32 grp, boffset, offset, itb;
 	groupdescriptor *gd;
 	gd_info *gi;
 	nod_info *ni;
 
-	curr = cache_find(&fs->inodes, nod);
-	if (curr) {
-		ni = container_of(curr, nod_info, link);
-		ni->usecount++;
+	offset = GRP_IBM_OFFSET(fs,nod) - 1;
+	boffset = offset / INODES_PER_BLOCK;
+	offset %= INODES_PER_BLOCK;
+	grp = GRP_GROUP_OF_INODE(fs,nod);
+	itb = grp * fs->itbs_per_group + boffset;
+
+	ni = fs->itbs[itb];
+	if (ni) {
+		fs->inodes.hits++;
+		if (ni->usecount++ == 0) {
+			// it's in the unused list, remove it
+			list_del(&ni->link.lru_link);
+			fs->inodes.lru_entries--;
+		}
 		goto out;
 	}
 
-	ni = malloc(sizeof(*ni));
+	fs->inodes.misses++;
+	evict_itbs(fs, fs->inodes.max_free_entries);
+	ni = pool_get(&fs->nod_pool);
 	if (!ni)
 		error_msg_and_die("get_nod: out of memory");
 	ni->fs = fs;
-	ni->nod = nod;
+	ni->itb = itb;
 	ni->usecount = 1;
-	cache_add(&fs->inodes, &ni->link);
-
-	offset = GRP_IBM_OFFSET(fs,nod) - 1;
-	boffset = offset / INODES_PER_BLOCK;
-	offset %= INODES_PER_BLOCK;
-	grp = GRP_GROUP_OF_INODE(fs,nod);
 	gd = get_gd(fs, grp, &gi);
 	ni->b = get_blk(fs, gd->bg_inode_table + boffset, &ni->bi);
-	ni->itab = ((inode *) ni->b) + offset;
-	if (fs->swapit)
-		swap_nod(ni->itab);
 	put_gd(gi);
+	if (fs->swapit)
+		swap_itb(ni->b);
+	fs->itbs[itb] = ni;
+	fs->inodes.entries++;
  out:
 	*rni = ni;
-	return ni->itab;
+	return ((inode *) ni->b) + offset;
+}
+
+static inline void
+mark_nod_dirty(nod_info *ni)
+{
+	mark_blk_dirty(ni->bi);
 }
 
 static inline void
@@ -1382,7 +1945,7 @@ put_dir(dirwalker *dw)
 	}
 
 	if (dw->nod == 0)
-		free_workblk(dw->b);
+		free_workblk(dw->fs, dw->b);
 	else
 		put_blk(dw->bi);
 }
@@ -1395,7 +1958,7 @@ new_dir(filesystem *fs, uint32 dnod, const char *name, int nlen, dirwalker *dw)
 	directory *d;
 
 	dw->fs = fs;
-	dw->b = get_workblk();
+	dw->b = get_workblk(fs);
 	dw->nod = 0;
 	dw->last_d = dw->b;
 	dw->need_flush = 1;
@@ -1407,6 +1970,15 @@ new_dir(filesystem *fs, uint32 dnod, const char *name, int nlen, dirwalker *dw)
 	return d;
 }
 
+// Flag the block being walked as modified.  Blocks made by new_dir
+// aren't in the block cache, they get copied in by extend_inode_blk.
+static inline void
+dir_mark_dirty(dirwalker *dw)
+{
+	if (dw->nod)
+		mark_blk_dirty(dw->bi);
+}
+
 // Shrink the current directory entry, make a new one with the free
 // space, and return the new directory entry (making it current).
 static inline directory *
@@ -1424,6 +1996,7 @@ shrink_dir(dirwalker *dw, uint32 nod, const char *name, int nlen)
 	memcpy(dw->last_d, &dw->d, sizeof(directory));
 
 	dw->last_d = dw->last_d + preclen;
+	dir_mark_dirty(dw);
 	d->d_rec_len = reclen;
 	d->d_inode = nod;
 	d->d_name_len = nlen;
@@ -1454,6 +2027,7 @@ dir_set_name(dirwalker *dw, const char *name, int nlen)
 {
 	dw->d.d_name_len = nlen;
 	strncpy(((char *) dw->last_d) + sizeof(directory), name, nlen);
+	dir_mark_dirty(dw);
 }
 
 // allocate a given block/inode in the bitmap
@@ -1467,19 +2041,13 @@ allocate(block b, uint32 item, uint32 *hint)
 	{
 		uint32 i;
 		uint32 start = hint ? *hint : 0;
-		for(i = start; i < BLOCKSIZE; i++)
-		{
-			uint8 bits = b[i];
-			if(bits != (uint8)-1)
-			{
-				item = i * 8 + __builtin_ctz(~bits) + 1;
-				break;
-			}
-		}
-		if(i == BLOCKSIZE)
+
+		i = bitmap_find_zero(b, start * 8, BLOCKSIZE * 8);
+		if(i == BLOCKSIZE * 8)
 			return 0;
+		item = i + 1;
 		if(hint)
-			*hint = i;
+			*hint = i / 8;
 	}
 	b[(item-1) / 8] |= (1 << ((item-1) % 8));
 	return item;
@@ -1492,17 +2060,116 @@ deallocate(block b, uint32 item)
 	b[(item-1) / 8] &= ~(1 << ((item-1) % 8));
 }
 
-// allocate a block
-static uint32
-alloc_blk(filesystem *fs, uint32 nod)
-{
-	uint32 bk=0;
-	uint32 grp,nbgroups;
-	blk_info *bi;
-	groupdescriptor *gd;
-	gd_info *gi;
+#define GRP_NONE ((uint32)-1)
 
-	grp = GRP_GROUP_OF_INODE(fs,nod);
+// Can alloc_nod put an inode in this group?  Group 0 is only used when
+// no other group can, so it never enters the tree.
+static inline int
+grp_eligible(grpsummary *gs, uint32 grp)
+{
+	return grp && gs->free_inodes[grp]
+		&& gs->free_inodes[grp] >= gs->avefreei;
+}
+
+// The better of two groups for alloc_nod, a being the lower one
+static inline uint32
+grp_better(grpsummary *gs, uint32 a, uint32 b)
+{
+	if (a == GRP_NONE)
+		return b;
+	if (b == GRP_NONE)
+		return a;
+	return gs->free_blocks[b] > gs->free_blocks[a] ? b : a;
+}
+
+static void
+grp_summary_rebuild(grpsummary *gs, uint32 avefreei)
+{
+	uint32 i;
+
+	gs->avefreei = avefreei;
+	for (i = 0; i < gs->nleaves; i++)
+		gs->tree[gs->nleaves + i] =
+			i < gs->ngroups && grp_eligible(gs, i) ? i : GRP_NONE;
+	for (i = gs->nleaves - 1; i > 0; i--)
+		gs->tree[i] = grp_better(gs, gs->tree[2*i], gs->tree[2*i+1]);
+	gs->rebuilds++;
+}
+
+// Read the counts of all groups once, from then on they are kept up to
+// date by the allocation functions
+static void
+grp_summary_init(filesystem *fs)
+{
+	grpsummary *gs = &fs->grps;
+	groupdescriptor *gd;
+	gd_info *gi;
+	uint32 i;
+
+	gs->ngroups = GRP_NBGROUPS(fs);
+	for (gs->nleaves = 1; gs->nleaves < gs->ngroups; gs->nleaves <<= 1)
+		/*nop*/;
+	gs->free_blocks = malloc(gs->ngroups * sizeof(uint32));
+	gs->free_inodes = malloc(gs->ngroups * sizeof(uint32));
+	gs->tree = malloc(2 * gs->nleaves * sizeof(uint32));
+	if (!gs->free_blocks || !gs->free_inodes || !gs->tree)
+		error_msg_and_die("not enough memory for group summary");
+	for (i = 0; i < gs->ngroups; i++) {
+		gd = get_gd(fs, i, &gi);
+		gs->free_blocks[i] = gd->bg_free_blocks_count;
+		gs->free_inodes[i] = gd->bg_free_inodes_count;
+		put_gd(gi);
+	}
+	gs->first_free = 0;
+	grp_summary_rebuild(gs, fs->sb->s_free_inodes_count / gs->ngroups);
+}
+
+// Record the new counts of a group after an allocation or a free
+static void
+grp_summary_update(filesystem *fs, uint32 grp, groupdescriptor *gd)
+{
+	grpsummary *gs = &fs->grps;
+	uint32 i;
+
+	if (!gs->tree)
+		return;
+	gs->free_blocks[grp] = gd->bg_free_blocks_count;
+	gs->free_inodes[grp] = gd->bg_free_inodes_count;
+	if (gs->free_blocks[grp] && grp < gs->first_free)
+		gs->first_free = grp;
+	i = gs->nleaves + grp;
+	gs->tree[i] = grp_eligible(gs, grp) ? grp : GRP_NONE;
+	for (i /= 2; i > 0; i /= 2)
+		gs->tree[i] = grp_better(gs, gs->tree[2*i], gs->tree[2*i+1]);
+}
+
+static void
+grp_summary_fini(grpsummary *gs)
+{
+	free(gs->free_blocks);
+	free(gs->free_inodes);
+	free(gs->tree);
+}
+
+// allocate a block
+static uint32
+alloc_blk(filesystem *fs, uint32 nod)
+{
+	uint32 bk=0;
+	uint32 grp,nbgroups;
+	blk_info *bi;
+	groupdescriptor *gd;
+	gd_info *gi;
+
+	grp = GRP_GROUP_OF_INODE(fs,nod);
+	if (fs->resv_left && fs->resv_nod == nod) {
+		// the bitmap and counts were updated by reserve_blks
+		bk = fs->resv_next++;
+		fs->resv_left--;
+		fs->blk_alloc_hint[fs->resv_grp] = bk / 8;
+		return fs->sb->s_first_data_block
+			+ fs->sb->s_blocks_per_group * fs->resv_grp + bk;
+	}
 	nbgroups = GRP_NBGROUPS(fs);
 	gd = get_gd(fs, grp, &gi);
 	if (gd->bg_free_blocks_count)
@@ -1510,17 +2177,34 @@ alloc_blk(filesystem *fs, uint32 nod)
 			      &fs->blk_alloc_hint[grp]);
 	else
 		bk = 0;
-	if (bk)
+	if (bk) {
+		mark_blk_dirty(bi);
 		GRP_PUT_GROUP_BBM(bi);
+	}
 	put_gd(gi);
 	if (!bk) {
-		for (grp=0; grp<nbgroups && !bk; grp++) {
+		// take the first group with free blocks, skipping the
+		// ones known to be full
+		grpsummary *gs = &fs->grps;
+
+		if (!gs->tree)
+			grp_summary_init(fs);
+		while (gs->first_free < nbgroups
+		       && !gs->free_blocks[gs->first_free])
+			gs->first_free++;
+		gs->fallbacks++;
+		for (grp=gs->first_free; grp<nbgroups && !bk; grp++) {
+			gs->fallback_grps++;
+			if (!gs->free_blocks[grp])
+				continue;
 			gd = get_gd(fs, grp, &gi);
 			if (gd->bg_free_blocks_count)
 				bk = allocate(GRP_GET_GROUP_BBM(fs, gd, &bi), 0,
 					      &fs->blk_alloc_hint[grp]);
-			if (bk)
+			if (bk) {
+				mark_blk_dirty(bi);
 				GRP_PUT_GROUP_BBM(bi);
+			}
 			put_gd(gi);
 		}
 		grp--;
@@ -1530,12 +2214,90 @@ alloc_blk(filesystem *fs, uint32 nod)
 	gd = get_gd(fs, grp, &gi);
 	if(!(gd->bg_free_blocks_count--))
 		error_msg_and_die("group descr %d. free blocks count == 0 (corrupted fs?)",grp);
+	mark_gd_dirty(gi);
+	grp_summary_update(fs, grp, gd);
 	put_gd(gi);
 	if(!(fs->sb->s_free_blocks_count--))
 		error_msg_and_die("superblock free blocks count == 0 (corrupted fs?)");
 	return fs->sb->s_first_data_block + fs->sb->s_blocks_per_group*grp + (bk-1);
 }
 
+// Reserve up to count blocks for inode nod, as one run starting at the
+// block alloc_blk would return next.  alloc_blk then hands them out in
+// order without touching the bitmap or group descriptor, which gives
+// the same layout as allocating them one at a time.  The run stops at
+// the first used block; anything more is allocated as usual.
+static void
+reserve_blks(filesystem *fs, uint32 nod, uint32 count)
+{
+	uint32 grp, start, end, n;
+	blk_info *bi;
+	gd_info *gi;
+	groupdescriptor *gd;
+	uint8 *bbm;
+
+	if (fs->resv_left)
+		error_msg_and_die("Internal error: blocks already reserved");
+	grp = GRP_GROUP_OF_INODE(fs,nod);
+	gd = get_gd(fs, grp, &gi);
+	if (!count || !gd->bg_free_blocks_count) {
+		put_gd(gi);
+		return;
+	}
+	bbm = GRP_GET_GROUP_BBM(fs, gd, &bi);
+	start = bitmap_find_zero(bbm, fs->blk_alloc_hint[grp] * 8, BLOCKSIZE * 8);
+	if (start == BLOCKSIZE * 8) {
+		GRP_PUT_GROUP_BBM(bi);
+		put_gd(gi);
+		return;
+	}
+	end = count < BLOCKSIZE * 8 - start ? start + count : BLOCKSIZE * 8;
+	n = bitmap_find_set(bbm, start, end) - start;
+	bitmap_fill(bbm, start, start + n, 1);
+	mark_blk_dirty(bi);
+	GRP_PUT_GROUP_BBM(bi);
+	if (gd->bg_free_blocks_count < n)
+		error_msg_and_die("group descr %d. free blocks count too low (corrupted fs?)", grp);
+	gd->bg_free_blocks_count -= n;
+	mark_gd_dirty(gi);
+	grp_summary_update(fs, grp, gd);
+	put_gd(gi);
+	if (fs->sb->s_free_blocks_count < n)
+		error_msg_and_die("superblock free blocks count too low (corrupted fs?)");
+	fs->sb->s_free_blocks_count -= n;
+	fs->resv_nod = nod;
+	fs->resv_grp = grp;
+	fs->resv_next = start;
+	fs->resv_left = n;
+	fs->resv_runs++;
+	fs->resv_blocks += n;
+}
+
+// Give back the reserved blocks that weren't used
+static void
+release_reserved_blks(filesystem *fs)
+{
+	blk_info *bi;
+	gd_info *gi;
+	groupdescriptor *gd;
+	uint8 *bbm;
+
+	if (!fs->resv_left)
+		return;
+	gd = get_gd(fs, fs->resv_grp, &gi);
+	bbm = GRP_GET_GROUP_BBM(fs, gd, &bi);
+	bitmap_fill(bbm, fs->resv_next, fs->resv_next + fs->resv_left, 0);
+	mark_blk_dirty(bi);
+	GRP_PUT_GROUP_BBM(bi);
+	gd->bg_free_blocks_count += fs->resv_left;
+	mark_gd_dirty(gi);
+	grp_summary_update(fs, fs->resv_grp, gd);
+	put_gd(gi);
+	fs->sb->s_free_blocks_count += fs->resv_left;
+	fs->resv_blocks -= fs->resv_left;
+	fs->resv_left = 0;
+}
+
 // free a block
 static void
 free_blk(filesystem *fs, uint32 bk)
@@ -1545,12 +2307,18 @@ free_blk(filesystem *fs, uint32 bk)
 	gd_info *gi;
 	groupdescriptor *gd;
 
+	bk -= fs->sb->s_first_data_block;
 	grp = bk / fs->sb->s_blocks_per_group;
 	bk %= fs->sb->s_blocks_per_group;
 	gd = get_gd(fs, grp, &gi);
-	deallocate(GRP_GET_GROUP_BBM(fs, gd, &bi), bk);
+	deallocate(GRP_GET_GROUP_BBM(fs, gd, &bi), bk + 1);
+	if (fs->reuse_freed_blks && bk / 8 < fs->blk_alloc_hint[grp])
+		fs->blk_alloc_hint[grp] = bk / 8;
+	mark_blk_dirty(bi);
 	GRP_PUT_GROUP_BBM(bi);
 	gd->bg_free_blocks_count++;
+	mark_gd_dirty(gi);
+	grp_summary_update(fs, grp, gd);
 	put_gd(gi);
 	fs->sb->s_free_blocks_count++;
 }
@@ -1559,42 +2327,37 @@ free_blk(filesystem *fs, uint32 bk)
 static uint32
 alloc_nod(filesystem *fs)
 {
-	uint32 nod,best_group=0;
-	uint32 grp,nbgroups,avefreei;
+	uint32 nod,best_group;
+	uint32 avefreei;
 	blk_info *bi;
-	gd_info *gi, *bestgi;
-	groupdescriptor *gd, *bestgd;
-
-	nbgroups = GRP_NBGROUPS(fs);
+	gd_info *bestgi;
+	groupdescriptor *bestgd;
+	grpsummary *gs = &fs->grps;
 
 	/* Distribute inodes amongst all the blocks                           */
 	/* For every block group with more than average number of free inodes */
 	/* find the one with the most free blocks and allocate node there     */
 	/* Idea from find_group_dir in fs/ext2/ialloc.c in 2.4.19 kernel      */
 	/* We do it for all inodes.                                           */
-	avefreei  =  fs->sb->s_free_inodes_count / nbgroups;
+	/* The group summary finds it without looking at every group.         */
+	if (!gs->tree)
+		grp_summary_init(fs);
+	avefreei  =  fs->sb->s_free_inodes_count / gs->ngroups;
+	if (avefreei != gs->avefreei)
+		grp_summary_rebuild(gs, avefreei);
+	best_group = gs->tree[1];
+	if (best_group == GRP_NONE)
+		best_group = 0;
 	bestgd = get_gd(fs, best_group, &bestgi);
-	for(grp=0; grp<nbgroups; grp++) {
-		gd = get_gd(fs, grp, &gi);
-		if (gd->bg_free_inodes_count < avefreei ||
-		    gd->bg_free_inodes_count == 0) {
-			put_gd(gi);
-			continue;
-		}
-		if (!best_group || gd->bg_free_blocks_count > bestgd->bg_free_blocks_count) {
-			put_gd(bestgi);
-			best_group = grp;
-			bestgd = gd;
-			bestgi = gi;
-		} else
-			put_gd(gi);
-	}
 	if (!(nod = allocate(GRP_GET_GROUP_IBM(fs, bestgd, &bi), 0,
 			     &fs->ino_alloc_hint[best_group])))
 		error_msg_and_die("couldn't allocate an inode (no free inode)");
+	mark_blk_dirty(bi);
 	GRP_PUT_GROUP_IBM(bi);
 	if(!(bestgd->bg_free_inodes_count--))
 		error_msg_and_die("group descr. free blocks count == 0 (corrupted fs?)");
+	mark_gd_dirty(bestgi);
+	grp_summary_update(fs, best_group, bestgd);
 	put_gd(bestgi);
 	if(!(fs->sb->s_free_inodes_count--))
 		error_msg_and_die("superblock free blocks count == 0 (corrupted fs?)");
@@ -1623,6 +2386,9 @@ init_bw(blockwalker *bw)
 {
 	bw->bnum = 0;
 	bw->bpdir = EXT2_INIT_BLOCK;
+	// only meaningful once walk_bw went past the direct blocks, but
+	// the walker may be copied before that
+	bw->bpind = bw->bpdind = bw->bptind = 0;
 }
 
 // return next block of inode (WALK_END for end)
@@ -1689,7 +2455,8 @@ walk_bw(filesystem *fs, uint32 nod, blockwalker *bw, int32 *create, uint32 hole)
 			iblk[bw->bpdir] = alloc_blk(fs,nod);
 		if(reduce) // free indirect block
 			free_blk(fs, iblk[bw->bpdir]);
-		b = get_blkmap(fs, iblk[bw->bpdir], &bmi1);
+		b = extend ? get_blkmap_new(fs, iblk[bw->bpdir], &bmi1)
+			: get_blkmap(fs, iblk[bw->bpdir], &bmi1);
 		bkref = &b[bw->bpind];
 		if(extend) // allocate first block
 			*bkref = hole ? 0 : alloc_blk(fs,nod);
@@ -1718,12 +2485,14 @@ walk_bw(filesystem *fs, uint32 nod, blockwalker *bw, int32 *create, uint32 hole)
 			iblk[bw->bpdir] = alloc_blk(fs,nod);
 		if(reduce) // free double indirect block
 			free_blk(fs, iblk[bw->bpdir]);
-		b = get_blkmap(fs, iblk[bw->bpdir], &bmi1);
+		b = extend ? get_blkmap_new(fs, iblk[bw->bpdir], &bmi1)
+			: get_blkmap(fs, iblk[bw->bpdir], &bmi1);
 		if(extend) // allocate first indirect block
 			b[bw->bpind] = alloc_blk(fs,nod);
 		if(reduce) // free  firstindirect block
 			free_blk(fs, b[bw->bpind]);
-		b = get_blkmap(fs, b[bw->bpind], &bmi2);
+		b = extend ? get_blkmap_new(fs, b[bw->bpind], &bmi2)
+			: get_blkmap(fs, b[bw->bpind], &bmi2);
 		bkref = &b[bw->bpdind];
 		if(extend) // allocate first block
 			*bkref = hole ? 0 : alloc_blk(fs,nod);
@@ -1753,7 +2522,8 @@ walk_bw(filesystem *fs, uint32 nod, blockwalker *bw, int32 *create, uint32 hole)
 			b[bw->bpind] = alloc_blk(fs,nod);
 		if(reduce) // free indirect block
 			free_blk(fs, b[bw->bpind]);
-		b = get_blkmap(fs, b[bw->bpind], &bmi2);
+		b = extend ? get_blkmap_new(fs, b[bw->bpind], &bmi2)
+			: get_blkmap(fs, b[bw->bpind], &bmi2);
 		bkref = &b[bw->bpdind];
 		if(extend) // allocate first block
 			*bkref = hole ? 0 : alloc_blk(fs,nod);
@@ -1776,17 +2546,20 @@ walk_bw(filesystem *fs, uint32 nod, blockwalker *bw, int32 *create, uint32 hole)
 			iblk[bw->bpdir] = alloc_blk(fs,nod);
 		if(reduce) // free triple indirect block
 			free_blk(fs, iblk[bw->bpdir]);
-		b = get_blkmap(fs, iblk[bw->bpdir], &bmi1);
+		b = extend ? get_blkmap_new(fs, iblk[bw->bpdir], &bmi1)
+			: get_blkmap(fs, iblk[bw->bpdir], &bmi1);
 		if(extend) // allocate first double indirect block
 			b[bw->bpind] = alloc_blk(fs,nod);
 		if(reduce) // free first double indirect block
 			free_blk(fs, b[bw->bpind]);
-		b = get_blkmap(fs, b[bw->bpind], &bmi2);
+		b = extend ? get_blkmap_new(fs, b[bw->bpind], &bmi2)
+			: get_blkmap(fs, b[bw->bpind], &bmi2);
 		if(extend) // allocate first indirect block
 			b[bw->bpdind] = alloc_blk(fs,nod);
 		if(reduce) // free first indirect block
 			free_blk(fs, b[bw->bpind]);
-		b = get_blkmap(fs, b[bw->bpdind], &bmi3);
+		b = extend ? get_blkmap_new(fs, b[bw->bpdind], &bmi3)
+			: get_blkmap(fs, b[bw->bpdind], &bmi3);
 		bkref = &b[bw->bptind];
 		if(extend) // allocate first data block
 			*bkref = hole ? 0 : alloc_blk(fs,nod);
@@ -1825,7 +2598,8 @@ walk_bw(filesystem *fs, uint32 nod, blockwalker *bw, int32 *create, uint32 hole)
 			b[bw->bpdind] = alloc_blk(fs,nod);
 		if(reduce) // free indirect block
 			free_blk(fs, b[bw->bpind]);
-		b = get_blkmap(fs, b[bw->bpdind], &bmi3);
+		b = extend ? get_blkmap_new(fs, b[bw->bpdind], &bmi3)
+			: get_blkmap(fs, b[bw->bpdind], &bmi3);
 		bkref = &b[bw->bptind];
 		if(extend) // allocate first data block
 			*bkref = hole ? 0 : alloc_blk(fs,nod);
@@ -1847,12 +2621,14 @@ walk_bw(filesystem *fs, uint32 nod, blockwalker *bw, int32 *create, uint32 hole)
 			b[bw->bpind] = alloc_blk(fs,nod);
 		if(reduce) // free double indirect block
 			free_blk(fs, b[bw->bpind]);
-		b = get_blkmap(fs, b[bw->bpind], &bmi2);
+		b = extend ? get_blkmap_new(fs, b[bw->bpind], &bmi2)
+			: get_blkmap(fs, b[bw->bpind], &bmi2);
 		if(extend) // allocate single indirect block
 			b[bw->bpdind] = alloc_blk(fs,nod);
 		if(reduce) // free indirect block
 			free_blk(fs, b[bw->bpind]);
-		b = get_blkmap(fs, b[bw->bpdind], &bmi3);
+		b = extend ? get_blkmap_new(fs, b[bw->bpdind], &bmi3)
+			: get_blkmap(fs, b[bw->bpdind], &bmi3);
 		bkref = &b[bw->bptind];
 		if(extend) // allocate first block
 			*bkref = hole ? 0 : alloc_blk(fs,nod);
@@ -1864,6 +2640,15 @@ walk_bw(filesystem *fs, uint32 nod, blockwalker *bw, int32 *create, uint32 hole)
 	/* End change for walking triple indirection */
 
 	bk = *bkref;
+	if (extend) {
+		if (bmi3)
+			mark_blkmap_dirty(bmi3);
+		if (bmi2)
+			mark_blkmap_dirty(bmi2);
+		if (bmi1)
+			mark_blkmap_dirty(bmi1);
+		mark_nod_dirty(ni);
+	}
 	if (bmi3)
 		put_blkmap(bmi3);
 	if (bmi2)
@@ -1871,23 +2656,109 @@ walk_bw(filesystem *fs, uint32 nod, blockwalker *bw, int32 *create, uint32 hole)
 	if (bmi1)
 		put_blkmap(bmi1);
 
+	// that the block is allocated is left to verify_fs
 	if(bk)
-	{
-		blk_info *bi;
-		gd_info *gi;
-		uint8 *block;
 		bw->bnum++;
-		block = GRP_GET_BLOCK_BITMAP(fs,bk,&bi,&gi);
-		if(!reduce && !allocated(block, GRP_BBM_OFFSET(fs,bk)))
-			error_msg_and_die("[block %d of inode %d is unallocated !]", bk, nod);
-		GRP_PUT_BLOCK_BITMAP(bi, gi);
-	}
 	if(extend)
 		inod->i_blocks = bw->bnum * INOBLK;
 	put_nod(ni);
 	return bk;
 }
 
+// Map count blocks from bw on, the same as count calls to walk_bw, and
+// put their numbers in bks.  With create, the blocks are appended, as
+// holes where hole (if not NULL) is set.  The inode is fetched once,
+// and the blocks that follow the previous one in the same block of
+// addresses are all mapped with the addresses held; walk_bw only does
+// the steps that change blocks of addresses.  Like walk_bw, it doesn't
+// check the blocks against the bitmaps.  Returns how many blocks
+// were mapped, which is less than count at the end of the file when not
+// creating.
+static uint32
+walk_bw_batch(filesystem *fs, uint32 nod, blockwalker *bw, uint32 *bks,
+	      uint32 count, int create, const uint8 *hole)
+{
+	blkmap_info *bmi1, *bmi2, *bmi3;
+	uint32 n = 0, limit, bk;
+	uint32 *b, *idx, *iblk;
+	inode *inod;
+	nod_info *ni;
+	int extended, end = 0;
+
+	inod = get_nod(fs, nod, &ni);
+	iblk = inod->i_block;
+	while (n < count && !end)
+	{
+		bmi1 = bmi2 = bmi3 = NULL;
+		b = NULL;
+		limit = BLOCKSIZE/4 - 1;
+		if (bw->bpdir == EXT2_INIT_BLOCK)
+			;
+		else if (bw->bpdir < EXT2_NDIR_BLOCKS) {
+			b = iblk;
+			idx = &bw->bpdir;
+			limit = EXT2_NDIR_BLOCKS;
+		} else if (bw->bpdir == EXT2_IND_BLOCK && bw->bpind < limit) {
+			b = get_blkmap(fs, iblk[bw->bpdir], &bmi1);
+			idx = &bw->bpind;
+		} else if (bw->bpdir == EXT2_DIND_BLOCK && bw->bpdind < limit) {
+			b = get_blkmap(fs, iblk[bw->bpdir], &bmi1);
+			b = get_blkmap(fs, b[bw->bpind], &bmi2);
+			idx = &bw->bpdind;
+		} else if (bw->bpdir == EXT2_TIND_BLOCK && bw->bptind < limit) {
+			b = get_blkmap(fs, iblk[bw->bpdir], &bmi1);
+			b = get_blkmap(fs, b[bw->bpind], &bmi2);
+			b = get_blkmap(fs, b[bw->bpdind], &bmi3);
+			idx = &bw->bptind;
+		}
+		if (!b) {
+			int32 one = 1;
+			bk = walk_bw(fs, nod, bw, create ? &one : NULL,
+				     hole && hole[n]);
+			if (bk == WALK_END)
+				break;
+			bks[n++] = bk;
+			continue;
+		}
+		extended = 0;
+		while (n < count && *idx < limit)
+		{
+			if (bw->bnum >= inod->i_blocks / INOBLK) {
+				if (!create) {
+					end = 1;
+					break;
+				}
+				bk = (hole && hole[n]) ? 0 : alloc_blk(fs, nod);
+				b[++*idx] = bk;
+				extended = 1;
+			} else
+				bk = b[++*idx];
+			if (bk)
+				bw->bnum++;
+			if (extended)
+				inod->i_blocks = bw->bnum * INOBLK;
+			bks[n++] = bk;
+		}
+		if (extended) {
+			if (bmi3)
+				mark_blkmap_dirty(bmi3);
+			else if (bmi2)
+				mark_blkmap_dirty(bmi2);
+			else if (bmi1)
+				mark_blkmap_dirty(bmi1);
+			mark_nod_dirty(ni);
+		}
+		if (bmi3)
+			put_blkmap(bmi3);
+		if (bmi2)
+			put_blkmap(bmi2);
+		if (bmi1)
+			put_blkmap(bmi1);
+	}
+	put_nod(ni);
+	return n;
+}
+
 typedef struct
 {
 	blockwalker bw;
@@ -1918,6 +2789,7 @@ inode_pos_init(filesystem *fs, inode_pos *ipos, uint32 nod, int op,
 		while(walk_bw(fs, nod, &ipos->bw, &create, 0) != WALK_END)
 			/*nop*/;
 		ipos->inod->i_blocks = 0;
+		mark_nod_dirty(ipos->ni);
 	}
 
 	if (endbw)
@@ -1942,164 +2814,680 @@ inode_pos_finish(filesystem *fs, inode_pos *ipos)
 
 // add blocks to an inode (file/dir/etc...) at the given position.
 // This will only work when appending to the end of an inode.
+#define EXTEND_BATCH 64
+
 static void
 extend_inode_blk(filesystem *fs, inode_pos *ipos, block b, int amount)
 {
-	uint32 bk;
-	uint32 pos;
+	uint32 bks[EXTEND_BATCH];
+	uint8 hole[EXTEND_BATCH];
+	uint32 i, n;
 
 	if (amount < 0)
 		error_msg_and_die("extend_inode_blk: Got negative amount");
 
-	for (pos = 0; amount; pos += BLOCKSIZE)
+	while (amount)
 	{
-		int hole = (fs->holes && is_blk_empty(b + pos));
-
-		bk = walk_bw(fs, ipos->nod, &ipos->bw, &amount, hole);
-		if (bk == WALK_END)
+		n = MIN(amount, EXTEND_BATCH);
+		if (fs->holes)
+			blks_empty(b, n, BLOCKSIZE, hole);
+		else
+			memset(hole, 0, n);
+		if (walk_bw_batch(fs, ipos->nod, &ipos->bw, bks, n, 1, hole) != n)
 			error_msg_and_die("extend_inode_blk: extend failed");
-		if (!hole) {
-			blk_info *bi;
-			uint8 *block = get_blk(fs, bk, &bi);
-			memcpy(block, b + pos, BLOCKSIZE);
-			put_blk(bi);
+		for (i = 0; i < n; i++, b += BLOCKSIZE) {
+			if (!hole[i]) {
+				blk_info *bi;
+				uint8 *block = get_blk_new(fs, bks[i], &bi);
+				memcpy(block, b, BLOCKSIZE);
+				put_blk(bi);
+			}
 		}
+		amount -= n;
 	}
 }
 
-// link an entry (inode #) to a directory
-static void
-add2dir(filesystem *fs, uint32 dnod, uint32 nod, const char* name)
+// Directories of at least DIRINDEX_MIN_BLOCKS blocks get an in-memory
+// index while the image is built: a hash of the names in use, the
+// block numbers, and for each block the largest entry add2dir could
+// put there.  find_dir then needs no walk at all and add2dir only
+// looks at the block it will use.  The index follows what add2dir
+// does, so the layout is the same as walking the directory.
+
+#define DIRINDEX_MIN_BLOCKS 4
+
+typedef struct dirindex_name_s
+{
+	struct dirindex_name_s *next;
+	uint32 nod;
+	uint32 blk;              // block index in the directory
+	uint32 off;              // entry offset in that block
+	uint32 nlen;
+	char name[];
+} dirindex_name;
+
+typedef struct dirindex_s
+{
+	struct dirindex_s *next;
+	uint32 dnod;
+	dirindex_name **names;
+	uint32 names_mask;
+	uint32 nnames;
+	uint32 nblocks;
+	uint32 blocks_size;
+	uint32 *bk;              // block numbers, in directory order
+	uint16 *room;            // largest rec_len add2dir can fit in each
+	blockwalker last_bw;     // position of the last block
+} dirindex;
+
+static inline uint32
+dirindex_name_hash(const char *name, uint32 nlen)
+{
+	uint32 h = 2166136261u;
+
+	while (nlen--)
+		h = (h ^ (uint8) *name++) * 16777619u;
+	return h;
+}
+
+static inline uint32
+dirindex_hash(uint32 dnod)
+{
+	return dnod * 2654435769u;
+}
+
+static dirindex *
+dirindex_get(filesystem *fs, uint32 dnod)
+{
+	dirindex *di;
+
+	if (!fs->dirindexes)
+		return NULL;
+	for (di = fs->dirindexes[dirindex_hash(dnod) & fs->dirindex_mask];
+	     di; di = di->next)
+		if (di->dnod == dnod)
+			return di;
+	return NULL;
+}
+
+// The space add2dir could take from the entries of a directory block:
+// the whole record of an unused entry, what follows the name of a used
+// one.
+static uint16
+dir_block_room(filesystem *fs, uint32 bk)
 {
-	blockwalker bw, lbw;
-	uint32 bk;
 	directory *d;
 	dirwalker dw;
-	uint32 reclen, nlen;
-	inode *node;
-	inode *pnode;
-	nod_info *dni, *ni;
-	inode_pos ipos;
+	uint32 room = 0, r;
 
-	pnode = get_nod(fs, dnod, &dni);
-	if((pnode->i_mode & FM_IFMT) != FM_IFDIR)
-		error_msg_and_die("can't add '%s' to a non-directory", name);
-	if(!*name)
-		error_msg_and_die("can't create an inode with an empty name");
-	if(strchr(name, '/'))
-		error_msg_and_die("bad name '%s' (contains a slash)", name);
-	nlen = strlen(name);
-	reclen = sizeof(directory) + rndup(nlen, 4);
-	if(reclen > BLOCKSIZE)
-		error_msg_and_die("bad name '%s' (too long)", name);
-	init_bw(&bw);
-	lbw = bw;
-	while((bk = walk_bw(fs, dnod, &bw, 0, 0)) != WALK_END) // for all blocks in dir
-	{
-		// for all dir entries in block
-		for(d = get_dir(fs, bk, &dw); d; d = next_dir(&dw))
-		{
-			// if empty dir entry, large enough, use it
-			if((!d->d_inode) && (d->d_rec_len >= reclen))
-			{
-				d->d_inode = nod;
-				node = get_nod(fs, nod, &ni);
-				dir_set_name(&dw, name, nlen);
-				put_dir(&dw);
-				node->i_links_count++;
-				put_nod(ni);
-				goto out;
-			}
-			// if entry with enough room (last one?), shrink it & use it
-			if(d->d_rec_len >= (sizeof(directory) + rndup(d->d_name_len, 4) + reclen))
-			{
-				d = shrink_dir(&dw, nod, name, nlen);
-				put_dir(&dw);
-				node = get_nod(fs, nod, &ni);
-				node->i_links_count++;
-				put_nod(ni);
-				goto out;
-			}
-		}
-		put_dir(&dw);
-		lbw = bw;
+	for (d = get_dir(fs, bk, &dw); d; d = next_dir(&dw)) {
+		if (!d->d_inode)
+			r = d->d_rec_len;
+		else
+			r = d->d_rec_len - sizeof(directory)
+				- rndup(d->d_name_len, 4);
+		if (r > room && r <= d->d_rec_len)
+			room = r;
 	}
-	// we found no free entry in the directory, so we add a block
-	node = get_nod(fs, nod, &ni);
-	d = new_dir(fs, nod, name, nlen, &dw);
-	node->i_links_count++;
-	put_nod(ni);
-	next_dir(&dw); // Force the data into the buffer
-
-	inode_pos_init(fs, &ipos, dnod, INODE_POS_EXTEND, &lbw);
-	extend_inode_blk(fs, &ipos, dir_data(&dw), 1);
-	inode_pos_finish(fs, &ipos);
-
 	put_dir(&dw);
-	pnode->i_size += BLOCKSIZE;
-out:
-	put_nod(dni);
+	return room;
 }
 
-// find an entry in a directory
-static uint32
-find_dir(filesystem *fs, uint32 nod, const char * name)
+// Record a name.  If it is already there, keep the entry find_dir
+// would see first.
+static void
+dirindex_add_name(dirindex *di, const char *name, uint32 nlen,
+		  uint32 nod, uint32 blk, uint32 off)
 {
-	blockwalker bw;
-	uint32 bk;
-	int nlen = strlen(name);
-	init_bw(&bw);
-	while((bk = walk_bw(fs, nod, &bw, 0, 0)) != WALK_END)
-	{
-		directory *d;
-		dirwalker dw;
-		for (d = get_dir(fs, bk, &dw); d; d=next_dir(&dw))
-			if(d->d_inode && (nlen == d->d_name_len) && !strncmp(dir_name(&dw), name, nlen)) {
-				uint32 result = d->d_inode;
-				put_dir(&dw);
-				return result;
+	dirindex_name *dn, **slot;
+	uint32 i;
+
+	if (di->nnames >= di->names_mask) {
+		uint32 nmask = di->names_mask * 2 + 1;
+		dirindex_name **nnames = calloc(nmask + 1, sizeof(*nnames));
+
+		if (!nnames)
+			error_msg_and_die("not enough memory for directory index");
+		for (i = 0; i <= di->names_mask; i++) {
+			while ((dn = di->names[i])) {
+				di->names[i] = dn->next;
+				slot = &nnames[dirindex_name_hash(dn->name, dn->nlen) & nmask];
+				dn->next = *slot;
+				*slot = dn;
 			}
-		put_dir(&dw);
+		}
+		free(di->names);
+		di->names = nnames;
+		di->names_mask = nmask;
 	}
-	return 0;
+	slot = &di->names[dirindex_name_hash(name, nlen) & di->names_mask];
+	for (dn = *slot; dn; dn = dn->next)
+		if (dn->nlen == nlen && !memcmp(dn->name, name, nlen)) {
+			if (blk < dn->blk || (blk == dn->blk && off < dn->off)) {
+				dn->nod = nod;
+				dn->blk = blk;
+				dn->off = off;
+			}
+			return;
+		}
+	dn = malloc(sizeof(*dn) + nlen);
+	if (!dn)
+		error_msg_and_die("not enough memory for directory index");
+	dn->nod = nod;
+	dn->blk = blk;
+	dn->off = off;
+	dn->nlen = nlen;
+	memcpy(dn->name, name, nlen);
+	dn->next = *slot;
+	*slot = dn;
+	di->nnames++;
 }
 
-// find the inode of a full path
 static uint32
-find_path(filesystem *fs, uint32 nod, const char * name)
+dirindex_find(dirindex *di, const char *name, uint32 nlen)
 {
-	char *p, *n, *n2 = xstrdup(name);
-	n = n2;
-	while(*n == '/')
-	{
-		nod = EXT2_ROOT_INO;
-		n++;
-	}
-	while(*n)
-	{
-		if((p = strchr(n, '/')))
-			(*p) = 0;
-		if(!(nod = find_dir(fs, nod, n)))
-			break;
-		if(p)
-			n = p + 1;
-		else
-			break;
-	}
-	free(n2);
-	return nod;
+	dirindex_name *dn;
+
+	for (dn = di->names[dirindex_name_hash(name, nlen) & di->names_mask];
+	     dn; dn = dn->next)
+		if (dn->nlen == nlen && !memcmp(dn->name, name, nlen))
+			return dn->nod;
+	return 0;
 }
 
-// chmod an inode
-void
-chmod_fs(filesystem *fs, uint32 nod, uint16 mode, uint16 uid, uint16 gid)
+static void
+dirindex_add_block(dirindex *di, uint32 bk, uint16 room)
 {
-	inode *node;
+	if (di->nblocks == di->blocks_size) {
+		di->blocks_size = di->blocks_size ? di->blocks_size * 2 : 16;
+		di->bk = realloc(di->bk, di->blocks_size * sizeof(*di->bk));
+		di->room = realloc(di->room, di->blocks_size * sizeof(*di->room));
+		if (!di->bk || !di->room)
+			error_msg_and_die("not enough memory for directory index");
+	}
+	di->bk[di->nblocks] = bk;
+	di->room[di->nblocks] = room;
+	di->nblocks++;
+}
+
+// Index a directory that is large enough to be worth it, by reading
+// it once.  Returns NULL for the small ones.
+static dirindex *
+dirindex_build(filesystem *fs, uint32 dnod, inode *dnode)
+{
+	dirindex *di, **slot;
+	blockwalker bw, lbw;
+	directory *d;
+	dirwalker dw;
+	uint32 bk, i;
+
+	if ((dnode->i_mode & FM_IFMT) != FM_IFDIR
+	    || dnode->i_size / BLOCKSIZE < DIRINDEX_MIN_BLOCKS)
+		return NULL;
+	if (fs->ndirindexes >= fs->dirindex_mask) {
+		uint32 nmask = fs->dirindex_mask * 2 + 1;
+		dirindex **ndis = calloc(nmask + 1, sizeof(*ndis));
+
+		if (!ndis)
+			error_msg_and_die("not enough memory for directory index");
+		for (i = 0; fs->dirindexes && i <= fs->dirindex_mask; i++) {
+			while ((di = fs->dirindexes[i])) {
+				fs->dirindexes[i] = di->next;
+				slot = &ndis[dirindex_hash(di->dnod) & nmask];
+				di->next = *slot;
+				*slot = di;
+			}
+		}
+		free(fs->dirindexes);
+		fs->dirindexes = ndis;
+		fs->dirindex_mask = nmask;
+	}
+	di = calloc(1, sizeof(*di));
+	if (!di)
+		error_msg_and_die("not enough memory for directory index");
+	di->dnod = dnod;
+	di->names_mask = 63;
+	di->names = calloc(di->names_mask + 1, sizeof(*di->names));
+	if (!di->names)
+		error_msg_and_die("not enough memory for directory index");
+	init_bw(&bw);
+	lbw = bw;
+	while ((bk = walk_bw(fs, dnod, &bw, 0, 0)) != WALK_END) {
+		for (d = get_dir(fs, bk, &dw); d; d = next_dir(&dw))
+			if (d->d_inode)
+				dirindex_add_name(di, dir_name(&dw),
+						  d->d_name_len, d->d_inode,
+						  di->nblocks,
+						  dw.last_d - dw.b);
+		put_dir(&dw);
+		dirindex_add_block(di, bk, dir_block_room(fs, bk));
+		lbw = bw;
+	}
+	di->last_bw = lbw;
+	slot = &fs->dirindexes[dirindex_hash(dnod) & fs->dirindex_mask];
+	di->next = *slot;
+	*slot = di;
+	fs->ndirindexes++;
+	fs->dirindex_builds++;
+	return di;
+}
+
+static void
+dirindex_free(dirindex *di)
+{
+	dirindex_name *dn;
+	uint32 j;
+
+	for (j = 0; j <= di->names_mask; j++) {
+		while ((dn = di->names[j])) {
+			di->names[j] = dn->next;
+			free(dn);
+		}
+	}
+	free(di->names);
+	free(di->bk);
+	free(di->room);
+	free(di);
+}
+
+// Forget the index of a directory whose blocks were rewritten
+static void
+dirindex_drop(filesystem *fs, uint32 dnod)
+{
+	dirindex *di, **slot;
+
+	if (!fs->dirindexes)
+		return;
+	for (slot = &fs->dirindexes[dirindex_hash(dnod) & fs->dirindex_mask];
+	     (di = *slot); slot = &di->next) {
+		if (di->dnod == dnod) {
+			*slot = di->next;
+			dirindex_free(di);
+			fs->ndirindexes--;
+			return;
+		}
+	}
+}
+
+static void
+dirindex_fini(filesystem *fs)
+{
+	dirindex *di;
+	uint32 i;
+
+	for (i = 0; fs->dirindexes && i <= fs->dirindex_mask; i++) {
+		while ((di = fs->dirindexes[i])) {
+			fs->dirindexes[i] = di->next;
+			dirindex_free(di);
+		}
+	}
+	free(fs->dirindexes);
+}
+
+// Paths find_path has resolved.  Each entry maps a path, relative to
+// the inode the walk started from, to the inode it names; every prefix
+// of a cached path is cached too.  Only paths that were found are kept,
+// and directory entries are never removed, so a new entry can only
+// change a cached result when it gives a directory a second entry with
+// the name of a cached component: find_dir would still return the
+// first one, but add2dir drops the whole cache then to stay on the safe
+// side.
+typedef struct pathcache_s
+{
+	struct pathcache_s *next;   // same path hash
+	struct pathcache_s *cnext;  // same last component hash
+	uint32 start;
+	uint32 nod;
+	uint32 dnod;                // directory holding the last component
+	uint32 hash;
+	uint32 chash;
+	uint32 len;
+	uint32 coff;                // where the last component starts
+	char path[];
+} pathcache;
+
+static inline uint32
+pathcache_hash(uint32 start, const char *path, uint32 len)
+{
+	return dirindex_name_hash(path, len) ^ dirindex_hash(start);
+}
+
+static pathcache *
+pathcache_find(filesystem *fs, uint32 start, const char *path, uint32 len)
+{
+	pathcache *pc;
+	uint32 h;
+
+	if (!fs->paths)
+		return NULL;
+	h = pathcache_hash(start, path, len);
+	for (pc = fs->paths[h & fs->path_mask]; pc; pc = pc->next)
+		if (pc->hash == h && pc->start == start && pc->len == len
+		    && !memcmp(pc->path, path, len))
+			return pc;
+	return NULL;
+}
+
+static void
+pathcache_grow(filesystem *fs)
+{
+	uint32 nmask = fs->path_mask * 2 + 1, i;
+	pathcache **npaths, **ncomps, *pc;
+
+	if (nmask < 255)
+		nmask = 255;
+	npaths = calloc(nmask + 1, sizeof(*npaths));
+	ncomps = calloc(nmask + 1, sizeof(*ncomps));
+	if (!npaths || !ncomps)
+		error_msg_and_die("not enough memory for the path cache");
+	for (i = 0; fs->paths && i <= fs->path_mask; i++) {
+		while ((pc = fs->paths[i])) {
+			fs->paths[i] = pc->next;
+			pc->next = npaths[pc->hash & nmask];
+			npaths[pc->hash & nmask] = pc;
+			pc->cnext = ncomps[pc->chash & nmask];
+			ncomps[pc->chash & nmask] = pc;
+		}
+	}
+	free(fs->paths);
+	free(fs->pathcomps);
+	fs->paths = npaths;
+	fs->pathcomps = ncomps;
+	fs->path_mask = nmask;
+}
+
+// remember that path (len bytes, its last component at coff) resolves
+// to nod from start, the last component being an entry of dnod
+static void
+pathcache_add(filesystem *fs, uint32 start, const char *path, uint32 len,
+	      uint32 coff, uint32 dnod, uint32 nod)
+{
+	pathcache *pc;
+
+	if (fs->npaths >= fs->path_mask)
+		pathcache_grow(fs);
+	pc = malloc(sizeof(*pc) + len);
+	if (!pc)
+		error_msg_and_die("not enough memory for the path cache");
+	pc->start = start;
+	pc->nod = nod;
+	pc->dnod = dnod;
+	pc->hash = pathcache_hash(start, path, len);
+	pc->chash = pathcache_hash(dnod, path + coff, len - coff);
+	pc->len = len;
+	pc->coff = coff;
+	memcpy(pc->path, path, len);
+	pc->next = fs->paths[pc->hash & fs->path_mask];
+	fs->paths[pc->hash & fs->path_mask] = pc;
+	pc->cnext = fs->pathcomps[pc->chash & fs->path_mask];
+	fs->pathcomps[pc->chash & fs->path_mask] = pc;
+	fs->npaths++;
+}
+
+static void
+pathcache_fini(filesystem *fs)
+{
+	pathcache *pc;
+	uint32 i;
+
+	for (i = 0; fs->paths && i <= fs->path_mask; i++) {
+		while ((pc = fs->paths[i])) {
+			fs->paths[i] = pc->next;
+			free(pc);
+		}
+	}
+	free(fs->paths);
+	free(fs->pathcomps);
+	fs->paths = fs->pathcomps = NULL;
+	fs->path_mask = 0;
+	fs->npaths = 0;
+}
+
+// dnod gets an entry called name: forget every path going through a
+// component of that name in dnod
+static void
+pathcache_forget(filesystem *fs, uint32 dnod, const char *name, uint32 nlen)
+{
+	pathcache *pc;
+	uint32 h;
+
+	if (!fs->npaths)
+		return;
+	h = pathcache_hash(dnod, name, nlen);
+	for (pc = fs->pathcomps[h & fs->path_mask]; pc; pc = pc->cnext)
+		if (pc->chash == h && pc->dnod == dnod
+		    && pc->len - pc->coff == nlen
+		    && !memcmp(pc->path + pc->coff, name, nlen)) {
+			pathcache_fini(fs);
+			fs->path_flushes++;
+			return;
+		}
+}
+
+// Put the entry in directory block bk if it fits, at the first place
+// that is large enough.  Returns 1 and the entry offset if it did.
+static int
+add2dir_blk(filesystem *fs, uint32 bk, uint32 nod, const char *name,
+	    uint32 nlen, uint32 reclen, uint32 *off)
+{
+	directory *d;
+	dirwalker dw;
+	inode *node;
+	nod_info *ni;
+
+	// for all dir entries in block
+	for(d = get_dir(fs, bk, &dw); d; d = next_dir(&dw))
+	{
+		// if empty dir entry, large enough, use it
+		if((!d->d_inode) && (d->d_rec_len >= reclen))
+		{
+			d->d_inode = nod;
+			node = get_nod(fs, nod, &ni);
+			dir_set_name(&dw, name, nlen);
+			*off = dw.last_d - dw.b;
+			put_dir(&dw);
+			node->i_links_count++;
+			mark_nod_dirty(ni);
+			put_nod(ni);
+			return 1;
+		}
+		// if entry with enough room (last one?), shrink it & use it
+		if(d->d_rec_len >= (sizeof(directory) + rndup(d->d_name_len, 4) + reclen))
+		{
+			d = shrink_dir(&dw, nod, name, nlen);
+			*off = dw.last_d - dw.b;
+			put_dir(&dw);
+			node = get_nod(fs, nod, &ni);
+			node->i_links_count++;
+			mark_nod_dirty(ni);
+			put_nod(ni);
+			return 1;
+		}
+	}
+	put_dir(&dw);
+	return 0;
+}
+
+// link an entry (inode #) to a directory
+static void
+add2dir(filesystem *fs, uint32 dnod, uint32 nod, const char* name)
+{
+	blockwalker bw, lbw;
+	uint32 bk, i, off;
+	dirwalker dw;
+	uint32 reclen, nlen;
+	inode *node;
+	inode *pnode;
+	nod_info *dni, *ni;
+	inode_pos ipos;
+	dirindex *di;
+
+	pnode = get_nod(fs, dnod, &dni);
+	if((pnode->i_mode & FM_IFMT) != FM_IFDIR)
+		error_msg_and_die("can't add '%s' to a non-directory", name);
+	if(!*name)
+		error_msg_and_die("can't create an inode with an empty name");
+	if(strchr(name, '/'))
+		error_msg_and_die("bad name '%s' (contains a slash)", name);
+	nlen = strlen(name);
+	reclen = sizeof(directory) + rndup(nlen, 4);
+	if(reclen > BLOCKSIZE)
+		error_msg_and_die("bad name '%s' (too long)", name);
+	pathcache_forget(fs, dnod, name, nlen);
+	if (pnode->i_flags & EXT2_INDEX_FL) {
+		// entries are added linearly, so drop the hash index
+		// like ext2 does; the blocks still read as a plain directory
+		pnode->i_flags &= ~EXT2_INDEX_FL;
+		mark_nod_dirty(dni);
+	}
+	if ((di = dirindex_get(fs, dnod)) || (di = dirindex_build(fs, dnod, pnode)))
+	{
+		// the first block with room is the one the walk would use
+		for (i = 0; i < di->nblocks; i++)
+			if (di->room[i] >= reclen)
+				break;
+		if (i < di->nblocks) {
+			if (!add2dir_blk(fs, di->bk[i], nod, name, nlen, reclen, &off))
+				error_msg_and_die("Internal error: directory index out of date");
+			di->room[i] = dir_block_room(fs, di->bk[i]);
+			dirindex_add_name(di, name, nlen, nod, i, off);
+			goto out;
+		}
+		lbw = di->last_bw;
+	}
+	else
+	{
+		init_bw(&bw);
+		lbw = bw;
+		while((bk = walk_bw(fs, dnod, &bw, 0, 0)) != WALK_END) // for all blocks in dir
+		{
+			if (add2dir_blk(fs, bk, nod, name, nlen, reclen, &off))
+				goto out;
+			lbw = bw;
+		}
+	}
+	// we found no free entry in the directory, so we add a block
+	node = get_nod(fs, nod, &ni);
+	new_dir(fs, nod, name, nlen, &dw);
+	node->i_links_count++;
+	mark_nod_dirty(ni);
+	put_nod(ni);
+	next_dir(&dw); // Force the data into the buffer
+
+	inode_pos_init(fs, &ipos, dnod, INODE_POS_EXTEND, &lbw);
+	extend_inode_blk(fs, &ipos, dir_data(&dw), 1);
+	if (di) {
+		// the new block is the one after the previous last one
+		bw = lbw;
+		bk = walk_bw(fs, dnod, &bw, 0, 0);
+		dirindex_add_block(di, bk, dir_block_room(fs, bk));
+		dirindex_add_name(di, name, nlen, nod, di->nblocks - 1, 0);
+		di->last_bw = bw;
+	}
+	inode_pos_finish(fs, &ipos);
+
+	put_dir(&dw);
+	pnode->i_size += BLOCKSIZE;
+	mark_nod_dirty(dni);
+out:
+	put_nod(dni);
+}
+
+// find an entry in a directory
+static uint32
+find_dir(filesystem *fs, uint32 nod, const char * name)
+{
+	blockwalker bw;
+	uint32 bk;
+	int nlen = strlen(name);
+	dirindex *di;
+	inode *dnode;
+	nod_info *dni;
+
+	if (!(di = dirindex_get(fs, nod))) {
+		dnode = get_nod(fs, nod, &dni);
+		di = dirindex_build(fs, nod, dnode);
+		put_nod(dni);
+	}
+	if (di) {
+		fs->dirindex_lookups++;
+		return dirindex_find(di, name, nlen);
+	}
+	init_bw(&bw);
+	while((bk = walk_bw(fs, nod, &bw, 0, 0)) != WALK_END)
+	{
+		directory *d;
+		dirwalker dw;
+		for (d = get_dir(fs, bk, &dw); d; d=next_dir(&dw))
+			if(d->d_inode && (nlen == d->d_name_len) && !strncmp(dir_name(&dw), name, nlen)) {
+				uint32 result = d->d_inode;
+				put_dir(&dw);
+				return result;
+			}
+		put_dir(&dw);
+	}
+	return 0;
+}
+
+// find the inode of a full path, starting from the longest prefix of
+// it that was resolved before
+static uint32
+find_path(filesystem *fs, uint32 nod, const char * name)
+{
+	char *p, *n, *n2;
+	uint32 len, start, dnod;
+	pathcache *pc = NULL;
+
+	while(*name == '/')
+	{
+		nod = EXT2_ROOT_INO;
+		name++;
+	}
+	start = nod;
+	n2 = xstrdup(name);
+	for (len = strlen(n2); len; len--)
+		if ((!n2[len] || n2[len] == '/')
+		    && (pc = pathcache_find(fs, start, n2, len)))
+			break;
+	n = n2 + len;
+	if (pc) {
+		fs->path_hits++;
+		nod = pc->nod;
+		if (*n)
+			n++;
+	} else
+		fs->path_misses++;
+	while(*n)
+	{
+		if((p = strchr(n, '/')))
+			(*p) = 0;
+		dnod = nod;
+		if(!(nod = find_dir(fs, dnod, n)))
+			break;
+		pathcache_add(fs, start, n2, n + strlen(n) - n2, n - n2, dnod, nod);
+		if(p)
+		{
+			(*p) = '/';
+			n = p + 1;
+		}
+		else
+			break;
+	}
+	free(n2);
+	return nod;
+}
+
+// chmod an inode
+void
+chmod_fs(filesystem *fs, uint32 nod, uint16 mode, uint16 uid, uint16 gid)
+{
+	inode *node;
 	nod_info *ni;
 	node = get_nod(fs, nod, &ni);
 	node->i_mode = (node->i_mode & ~FM_IMASK) | (mode & FM_IMASK);
 	node->i_uid = uid;
 	node->i_gid = gid;
+	mark_nod_dirty(ni);
 	put_nod(ni);
 }
 
@@ -2135,6 +3523,7 @@ mknod_fs(filesystem *fs, uint32 parent_nod, const char *name, uint16 mode, uint1
 		add2dir(fs, nod, nod, ".");
 		add2dir(fs, nod, parent_nod, "..");
 		get_gd(fs,GRP_GROUP_OF_INODE(fs,nod),&gi)->bg_used_dirs_count++;
+		mark_gd_dirty(gi);
 		put_gd(gi);
 		break;
 	}
@@ -2143,6 +3532,7 @@ mknod_fs(filesystem *fs, uint32 parent_nod, const char *name, uint16 mode, uint1
 	node->i_atime = mtime;
 	node->i_ctime = ctime;
 	node->i_mtime = mtime;
+	mark_nod_dirty(ni);
 	put_nod(ni);
 	return nod;
 }
@@ -2218,6 +3608,7 @@ mklink_fs(filesystem *fs, uint32 parent_nod, const char *name, size_t size, uint
 		extend_inode_blk(fs, &ipos, b, rndup(size, BLOCKSIZE) / BLOCKSIZE);
 
 	inode_pos_finish(fs, &ipos);
+	mark_nod_dirty(ni);
 	put_nod(ni);
 	return nod;
 }
@@ -2394,7 +3785,7 @@ set_xattrs(filesystem *fs, uint32 nod, struct xattr_item *items, int count)
 
 	// Allocate a block for xattrs
 	blk = alloc_blk(fs, nod);
-	b = get_blk(fs, blk, &bi);
+	b = get_blk_new(fs, blk, &bi);
 	memset(b, 0, BLOCKSIZE);
 
 	// Fill header
@@ -2451,12 +3842,14 @@ set_xattrs(filesystem *fs, uint32 nod, struct xattr_item *items, int count)
 
 	if (fs->swapit)
 		swap_xattr(b);
+	mark_blk_dirty(bi);
 	put_blk(bi);
 
 	// Set i_file_acl on the inode
 	node = get_nod(fs, nod, &ni);
 	node->i_file_acl = blk;
 	node->i_blocks += INOBLK;
+	mark_nod_dirty(ni);
 	put_nod(ni);
 
 	// Set the compat feature flag
@@ -2493,128 +3886,203 @@ off_t fh_read(filesystem *fs, inode_pos *ipos, off_t size, void *data)
 	return size;
 }
 
-#ifdef HAVE_LIBARCHIVE
-off_t la_read(filesystem *fs, inode_pos *ipos, off_t s /* ignored */, void *data)
-{
-	size_t readbytes;
-	off_t actual_size = 0;
-	int fullsize;
-
-	uint8 * b = malloc(CB_SIZE);
-	if (!b)
-		error_msg_and_die("mkfile_fs: out of memory");
+// A file read in memory beforehand, see struct prefetcher
+struct fbuf {
+	uint8 *data;             // rounded up to whole blocks, zero padded
+	size_t len;
+};
 
-	readbytes = archive_read_data((struct archive *)data, b, CB_SIZE);
-	while (readbytes) {
-		actual_size += readbytes;
-		fullsize = rndup(readbytes, BLOCKSIZE);
-		// Fill to end of block with zeros.
-		memset(b + readbytes, 0, fullsize - readbytes);
-		extend_inode_blk(fs, ipos, b, fullsize / BLOCKSIZE);
-		readbytes = archive_read_data((struct archive *)data, b, CB_SIZE);
+off_t buf_read(filesystem *fs, inode_pos *ipos, off_t size, void *data)
+{
+	struct fbuf *fb = data;
+	size_t pos, len;
+
+	// same chunks as fh_read, so the blocks end up the same
+	for (pos = 0; pos < fb->len; pos += len) {
+		len = MIN(fb->len - pos, CB_SIZE);
+		extend_inode_blk(fs, ipos, fb->data + pos,
+				 rndup(len, BLOCKSIZE) / BLOCKSIZE);
 	}
+	return size;
+}
 
-	free(b);
+// Reads len bytes of fd at pos into b and adds them to the file, like
+// fh_read does with a chunk.  Returns how much was read.
+static size_t
+fd_read_blks(filesystem *fs, inode_pos *ipos, int fd, off_t pos, size_t len, uint8 *b)
+{
+	size_t done = 0;
+	ssize_t n;
 
-	return actual_size;
+	while (done < len) {
+		n = pread(fd, b + done, len - done, pos + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	if (done) {
+		memset(b + done, 0, rndup(done, BLOCKSIZE) - done);
+		extend_inode_blk(fs, ipos, b, rndup(done, BLOCKSIZE) / BLOCKSIZE);
+	}
+	return done;
+}
 
+#define COPY_RUN 256
 
-}
+// Copies count blocks of fd from pos to the image blocks from bk on.
+// Returns how many whole blocks were copied, 0 once copy_file_range
+// turned out not to work here.
+static uint32
+copy_range_blks(filesystem *fs, int fd, off_t pos, uint32 bk, uint32 count)
+{
+#if HAVE_COPY_FILE_RANGE
+	off_t dst = ((off_t) bk) * BLOCKSIZE;
+	size_t want = ((size_t) count) * BLOCKSIZE, done = 0;
+	ssize_t n;
+
+	while (!fs->no_copy_range && done < want) {
+		n = copy_file_range(fd, &pos, fileno(fs->f), &dst, want - done, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && !done)
+			fs->no_copy_range = 1;
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	fs->copy_range_bytes += done;
+	return done / BLOCKSIZE;
+#else
+	fs->no_copy_range = 1;
+	return 0;
 #endif
+}
 
-// make a file from a FILE*
-static uint32
-mkfile_fs(filesystem *fs, uint32 parent_nod, const char *name, uint32 mode, file_read_cb read_cb, void *data, off_t size, uid_t uid, gid_t gid, uint32 ctime, uint32 mtime)
+// Same as fh_read for a file that can be read at any offset.  The
+// whole blocks go from the file to the image with copy_file_range,
+// which needs no copy through here and can share the data on
+// filesystems with reflinks.  With -z, the holes of the file are found
+// with SEEK_DATA and SEEK_HOLE and are not read at all; the data still
+// is, to find the blocks of zeros in it.  The blocks are allocated in
+// the same order either way, so the image is the same as with fh_read.
+off_t fh_copy(filesystem *fs, inode_pos *ipos, off_t size, void *data)
 {
-	uint32 nod = mknod_fs(fs, parent_nod, name, mode|FM_IFREG, uid, gid, 0, 0, ctime, mtime);
-	nod_info *ni;
-	inode *node = get_nod(fs, nod, &ni);
-	off_t actual_size;
-	inode_pos ipos;
+	int fd = fileno((FILE *)data);
+	uint32 bks[COPY_RUN];
+	uint8 holes[COPY_RUN];
+	off_t pos = 0;
+	uint8 *b, *block;
+	blk_info *bi;
+	ssize_t r;
 
-	inode_pos_init(fs, &ipos, nod, INODE_POS_TRUNCATE, NULL);
-
-	actual_size = read_cb(fs, &ipos, size, data);
-
-	if (actual_size > 0x7fffffff) {
-		if (fs->sb->s_rev_level < 1)
-			fs_upgrade_rev1_largefile(fs);
-		fs->sb->s_feature_ro_compat |= EXT2_FEATURE_RO_COMPAT_LARGE_FILE;
+	b = malloc(CB_SIZE);
+	if (!b)
+		error_msg_and_die("mkfile_fs: out of memory");
+	memset(holes, 1, sizeof(holes));
+	while (pos < size) {
+		size_t len = MIN(size - pos, CB_SIZE);
+		uint32 nb, i, j;
+		struct stat st;
+		off_t eof = size;
+
+		// like fh_read, stop at the end of a file that got shorter
+		// since it was stat'ed
+		if (fstat(fd, &st))
+			perror_msg_and_die("fh_copy: fstat");
+		if (st.st_size < eof)
+			eof = st.st_size;
+		if (pos >= eof)
+			break;
+		if (fs->holes) {
+#ifdef SEEK_DATA
+			off_t end = lseek(fd, pos, SEEK_DATA);
+
+			if (end < 0)
+				end = errno == ENXIO ? eof : pos;
+			for (nb = (MIN(end, eof) - pos) / BLOCKSIZE; nb; nb -= i) {
+				i = MIN(nb, COPY_RUN);
+				if (walk_bw_batch(fs, ipos->nod, &ipos->bw, bks, i, 1, holes) != i)
+					error_msg_and_die("extend_inode_blk: extend failed");
+				pos += ((off_t) i) * BLOCKSIZE;
+			}
+			if (pos >= size)
+				break;
+			if ((end = lseek(fd, pos, SEEK_HOLE)) > pos)
+				len = MIN(len, rndup(end - pos, BLOCKSIZE));
+#endif
+			if (!(len = fd_read_blks(fs, ipos, fd, pos, len, b)))
+				break;
+			pos += len;
+			continue;
+		}
+		nb = MIN((eof - pos) / BLOCKSIZE, COPY_RUN);
+		if (fs->no_copy_range || !nb) {
+			if (!(len = fd_read_blks(fs, ipos, fd, pos, len, b)))
+				break;
+			pos += len;
+			continue;
+		}
+		if (walk_bw_batch(fs, ipos->nod, &ipos->bw, bks, nb, 1, NULL) != nb)
+			error_msg_and_die("extend_inode_blk: extend failed");
+		for (i = 0; i < nb; i = j) {
+			// the run of consecutive blocks from i that the block
+			// cache doesn't hold
+			for (j = i; j < nb && bks[j] == bks[i] + (j - i)
+				    && (fs->map || !cache_lookup(&fs->blks, bks[j])); j++)
+				;
+			if (j > i && (j = i + copy_range_blks(fs, fd,
+					pos + ((off_t) i) * BLOCKSIZE, bks[i], j - i)) > i)
+				continue;
+			block = get_blk_new(fs, bks[i], &bi);
+			do
+				r = pread(fd, block, BLOCKSIZE, pos + ((off_t) i) * BLOCKSIZE);
+			while (r < 0 && errno == EINTR);
+			if (r < 0)
+				perror_msg_and_die("fh_copy: read");
+			// the file was there a moment ago, and the blocks for
+			// it are already allocated
+			if (r < BLOCKSIZE)
+				error_msg_and_die("fh_copy: short read, file changed while being copied");
+			put_blk(bi);
+			j = i + 1;
+		}
+		pos += ((off_t) nb) * BLOCKSIZE;
 	}
-	node->i_dir_acl = actual_size >> 32;
-	node->i_size = actual_size;
-	inode_pos_finish(fs, &ipos);
-	put_nod(ni);
-	return nod;
+	free(b);
+
+	return size;
 }
 
-// retrieves a mode info from a struct stat
-static uint32
-get_mode(struct stat *st)
+#ifdef HAVE_LIBARCHIVE
+off_t la_read(filesystem *fs, inode_pos *ipos, off_t s /* ignored */, void *data)
 {
-	uint32 mode = 0;
+	size_t readbytes;
+	off_t actual_size = 0;
+	int fullsize;
 
-	if(st->st_mode & S_IRUSR)
-		mode |= FM_IRUSR;
-	if(st->st_mode & S_IWUSR)
-		mode |= FM_IWUSR;
-	if(st->st_mode & S_IXUSR)
-		mode |= FM_IXUSR;
-	if(st->st_mode & S_IRGRP)
-		mode |= FM_IRGRP;
-	if(st->st_mode & S_IWGRP)
-		mode |= FM_IWGRP;
-	if(st->st_mode & S_IXGRP)
-		mode |= FM_IXGRP;
-	if(st->st_mode & S_IROTH)
-		mode |= FM_IROTH;
-	if(st->st_mode & S_IWOTH)
-		mode |= FM_IWOTH;
-	if(st->st_mode & S_IXOTH)
-		mode |= FM_IXOTH;
-	if(st->st_mode & S_ISUID)
-		mode |= FM_ISUID;
-	if(st->st_mode & S_ISGID)
-		mode |= FM_ISGID;
-	if(st->st_mode & S_ISVTX)
-		mode |= FM_ISVTX;
-	return mode;
-}
+	uint8 * b = malloc(CB_SIZE);
+	if (!b)
+		error_msg_and_die("mkfile_fs: out of memory");
 
-#define OCTAL_READ(field) tar_numeric_field_read((unsigned char*)field, sizeof field)
+	readbytes = archive_read_data((struct archive *)data, b, CB_SIZE);
+	while (readbytes) {
+		actual_size += readbytes;
+		fullsize = rndup(readbytes, BLOCKSIZE);
+		// Fill to end of block with zeros.
+		memset(b + readbytes, 0, fullsize - readbytes);
+		extend_inode_blk(fs, ipos, b, fullsize / BLOCKSIZE);
+		readbytes = archive_read_data((struct archive *)data, b, CB_SIZE);
+	}
+
+	free(b);
+
+	return actual_size;
 
-long long tar_numeric_field_read(unsigned char *field, size_t size)
-{
-	size_t i;
-	unsigned long long res = 0;
-	// this is the 256-based GNU extension
-	if(*field == 0x80 || *field == 0xff)
-	{
-		if(*field == 0xff)
-			res = -1;
-		for(i = 1; i < size; i++)
-			res = (res << 8) + field[i];
-	} else
-		for(i = 0; i < size; i++)
-		{
-			char c = field[i];
-			if(c == ' ')
-				continue;
-			if(c < '0' || c > '7')
-				break;
-			res = 8 * res + c - '0';
-		}
-	return res;
-}
 
-int is_zero(char *block, size_t size)
-{
-	size_t i;
-	for(i = 0; i < size; i++)
-		if(block[i])
-			return 0;
-	return 1;
 }
+#endif
 
 // Calculate total blocks needed on disk for a file of given size,
 // including indirect, double-indirect and triple-indirect blocks.
@@ -2665,20 +4133,533 @@ calc_file_alloc_blocks(unsigned long size)
 		return final_file_blocks;
 	}
 
-	// All 2nd indirect blocks used
-	file_blocks -= double_blocks;
-	final_file_blocks += 1 + ADDR_PER_BLOCK + double_blocks;
+	// All 2nd indirect blocks used
+	file_blocks -= double_blocks;
+	final_file_blocks += 1 + ADDR_PER_BLOCK + double_blocks;
+
+	// Need 3rd indirection
+	if(file_blocks / double_blocks <= (long)ADDR_PER_BLOCK)
+	{
+		long indirect_blocks = 1 + (file_blocks + double_blocks - 1) / double_blocks
+		                         + (file_blocks + ADDR_PER_BLOCK - 1) / ADDR_PER_BLOCK;
+		final_file_blocks += file_blocks + indirect_blocks;
+		return final_file_blocks;
+	}
+
+	return -1;
+}
+
+// Hashed (htree) directories.  Once the image is populated, directories
+// of more than one block are rewritten as a dx_root block holding "."
+// and "..", an optional level of index blocks, and leaf blocks with
+// the entries sorted by hash.  The leaves are ordinary directory
+// blocks, so readers without dir_index still see a linear directory.
+
+#define DX_HASH_HALF_MD4	1
+#define DX_ROOT_INFO_OFFSET	24  // after the "." and ".." entries
+#define DX_ROOT_ENTRIES_OFFSET	32
+#define DX_NODE_ENTRIES_OFFSET	8   // after an empty entry covering the block
+
+#define HMD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define HMD4_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define HMD4_H(x, y, z) ((x) ^ (y) ^ (z))
+#define HMD4_ROUND(f, a, b, c, d, x, s) \
+	(a += f(b, c, d) + (x), a = (a << (s)) | (a >> (32 - (s))))
+#define HMD4_K2 013240474631UL
+#define HMD4_K3 015666365641UL
+
+// Basic cut-down MD4 transform, as used by ext2/3 for directory hashes
+static void
+half_md4_transform(uint32 buf[4], const uint32 in[8])
+{
+	uint32 a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	HMD4_ROUND(HMD4_F, a, b, c, d, in[0],  3);
+	HMD4_ROUND(HMD4_F, d, a, b, c, in[1],  7);
+	HMD4_ROUND(HMD4_F, c, d, a, b, in[2], 11);
+	HMD4_ROUND(HMD4_F, b, c, d, a, in[3], 19);
+	HMD4_ROUND(HMD4_F, a, b, c, d, in[4],  3);
+	HMD4_ROUND(HMD4_F, d, a, b, c, in[5],  7);
+	HMD4_ROUND(HMD4_F, c, d, a, b, in[6], 11);
+	HMD4_ROUND(HMD4_F, b, c, d, a, in[7], 19);
+
+	HMD4_ROUND(HMD4_G, a, b, c, d, in[1] + HMD4_K2,  3);
+	HMD4_ROUND(HMD4_G, d, a, b, c, in[3] + HMD4_K2,  5);
+	HMD4_ROUND(HMD4_G, c, d, a, b, in[5] + HMD4_K2,  9);
+	HMD4_ROUND(HMD4_G, b, c, d, a, in[7] + HMD4_K2, 13);
+	HMD4_ROUND(HMD4_G, a, b, c, d, in[0] + HMD4_K2,  3);
+	HMD4_ROUND(HMD4_G, d, a, b, c, in[2] + HMD4_K2,  5);
+	HMD4_ROUND(HMD4_G, c, d, a, b, in[4] + HMD4_K2,  9);
+	HMD4_ROUND(HMD4_G, b, c, d, a, in[6] + HMD4_K2, 13);
+
+	HMD4_ROUND(HMD4_H, a, b, c, d, in[3] + HMD4_K3,  3);
+	HMD4_ROUND(HMD4_H, d, a, b, c, in[7] + HMD4_K3,  9);
+	HMD4_ROUND(HMD4_H, c, d, a, b, in[2] + HMD4_K3, 11);
+	HMD4_ROUND(HMD4_H, b, c, d, a, in[6] + HMD4_K3, 15);
+	HMD4_ROUND(HMD4_H, a, b, c, d, in[1] + HMD4_K3,  3);
+	HMD4_ROUND(HMD4_H, d, a, b, c, in[5] + HMD4_K3,  9);
+	HMD4_ROUND(HMD4_H, c, d, a, b, in[0] + HMD4_K3, 11);
+	HMD4_ROUND(HMD4_H, b, c, d, a, in[4] + HMD4_K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+// Pack a name into num words, padded with its length (unsigned chars)
+static void
+str2hashbuf(const char *msg, int len, uint32 *buf, int num)
+{
+	const uint8 *p = (const uint8 *) msg;
+	uint32 pad, val;
+	int i;
+
+	pad = (uint32) len | ((uint32) len << 8);
+	pad |= pad << 16;
+	val = pad;
+	if (len > num * 4)
+		len = num * 4;
+	for (i = 0; i < len; i++) {
+		val = p[i] + (val << 8);
+		if ((i % 4) == 3) {
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+	if (--num >= 0)
+		*buf++ = val;
+	while (--num >= 0)
+		*buf++ = pad;
+}
+
+// Half-MD4 hash of a name with the default (all zero) seed.  The low
+// bit of the major hash is left clear, it marks collisions in the index.
+static void
+dx_hash(const char *name, int len, uint32 *hash, uint32 *minor)
+{
+	uint32 buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	uint32 in[8];
+
+	while (len > 0) {
+		str2hashbuf(name, len, in, 8);
+		half_md4_transform(buf, in);
+		len -= 32;
+		name += 32;
+	}
+	*hash = buf[1] & ~1;
+	*minor = buf[2];
+}
+
+typedef struct
+{
+	uint32 hash;
+	uint32 minor;
+	uint32 nod;
+	uint32 nlen;
+	size_t off;              // of the name while they are collected
+	const char *name;
+} dx_entry_info;
+
+static int
+dx_entry_cmp(const void *a, const void *b)
+{
+	const dx_entry_info *ea = a, *eb = b;
+	uint32 len;
+	int r;
+
+	if (ea->hash != eb->hash)
+		return ea->hash < eb->hash ? -1 : 1;
+	if (ea->minor != eb->minor)
+		return ea->minor < eb->minor ? -1 : 1;
+	len = ea->nlen < eb->nlen ? ea->nlen : eb->nlen;
+	if ((r = memcmp(ea->name, eb->name, len)))
+		return r;
+	return ea->nlen < eb->nlen ? -1 : ea->nlen > eb->nlen;
+}
+
+// the index fields are always little endian
+static inline void
+dx_put16(filesystem *fs, uint8 *p, uint16 v)
+{
+	if (fs->swapit)
+		v = swab16(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline void
+dx_put32(filesystem *fs, uint8 *p, uint32 v)
+{
+	if (fs->swapit)
+		v = swab32(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+// Write a directory entry at p, returning the next position
+static uint8 *
+dx_put_dir(filesystem *fs, uint8 *p, uint32 nod, uint32 rec_len,
+	   const char *name, uint32 nlen)
+{
+	directory d;
+
+	d.d_inode = nod;
+	d.d_rec_len = rec_len;
+	d.d_name_len = nlen;
+	if (fs->swapit)
+		swap_dir(&d);
+	memcpy(p, &d, sizeof(d));
+	memcpy(p + sizeof(d), name, nlen);
+	return p + rec_len;
+}
+
+// Set the count/limit header and the entries of an index block
+static void
+dx_put_entries(filesystem *fs, uint8 *p, uint32 limit, uint32 count,
+	       const uint32 *hashes, uint32 first_blk)
+{
+	uint32 i;
+
+	dx_put16(fs, p, limit);
+	dx_put16(fs, p + 2, count);
+	dx_put32(fs, p + 4, first_blk);
+	for (i = 1; i < count; i++) {
+		dx_put32(fs, p + 8 * i, hashes[i]);
+		dx_put32(fs, p + 8 * i + 4, first_blk + i);
+	}
+}
+
+// Rewrite a directory as a hashed directory.  Returns 0 if it was left
+// alone: too few entries to fill its blocks, too many for two index
+// levels, or not enough free blocks for the new layout.
+static int
+dx_index_dir(filesystem *fs, uint32 dnod)
+{
+	blockwalker bw;
+	dirwalker dw;
+	directory *d;
+	dx_entry_info *ents = NULL;
+	uint32 nents = 0, maxents = 0;
+	char *names = NULL;
+	size_t names_len = 0, names_size = 0;
+	uint32 *hashes;
+	uint32 bk, parent = 0, i, j, k;
+	uint32 nleaves, nidx, nblocks, levels, root_limit, node_limit;
+	uint32 old_alloc;
+	long new_alloc;
+	uint8 *buf, *p, *end;
+	inode *dnode;
+	nod_info *dni;
+	inode_pos ipos;
+
+	// collect the entries
+	init_bw(&bw);
+	while ((bk = walk_bw(fs, dnod, &bw, 0, 0)) != WALK_END) {
+		for (d = get_dir(fs, bk, &dw); d; d = next_dir(&dw)) {
+			if (!d->d_inode)
+				continue;
+			if (d->d_name_len == 2 && !strncmp(dir_name(&dw), "..", 2)) {
+				parent = d->d_inode;
+				continue;
+			}
+			if (d->d_name_len == 1 && dir_name(&dw)[0] == '.')
+				continue;
+			if (nents == maxents) {
+				maxents = maxents ? maxents * 2 : 256;
+				ents = realloc(ents, maxents * sizeof(*ents));
+				if (!ents)
+					error_msg_and_die("not enough memory for directory index");
+			}
+			if (names_len + d->d_name_len > names_size) {
+				names_size = names_size ? names_size * 2 : 4096;
+				names_size += d->d_name_len;
+				names = realloc(names, names_size);
+				if (!names)
+					error_msg_and_die("not enough memory for directory index");
+			}
+			memcpy(names + names_len, dir_name(&dw), d->d_name_len);
+			ents[nents].nod = d->d_inode;
+			ents[nents].nlen = d->d_name_len;
+			ents[nents].off = names_len;
+			names_len += d->d_name_len;
+			nents++;
+		}
+		put_dir(&dw);
+	}
+	for (i = 0; i < nents; i++) {
+		ents[i].name = names + ents[i].off;
+		dx_hash(ents[i].name, ents[i].nlen, &ents[i].hash, &ents[i].minor);
+	}
+	qsort(ents, nents, sizeof(*ents), dx_entry_cmp);
+
+	// count the leaves, filling each before starting the next
+	nleaves = nents ? 1 : 0;
+	for (i = 0, k = 0; i < nents; i++) {
+		uint32 reclen = sizeof(directory) + rndup(ents[i].nlen, 4);
+		if (k + reclen > BLOCKSIZE) {
+			nleaves++;
+			k = 0;
+		}
+		k += reclen;
+	}
+	root_limit = (BLOCKSIZE - DX_ROOT_ENTRIES_OFFSET) / 8;
+	node_limit = (BLOCKSIZE - DX_NODE_ENTRIES_OFFSET) / 8;
+	if (nleaves <= root_limit) {
+		levels = 0;
+		nidx = 0;
+	} else {
+		levels = 1;
+		nidx = (nleaves + node_limit - 1) / node_limit;
+	}
+	nblocks = 1 + nidx + nleaves;
+	dnode = get_nod(fs, dnod, &dni);
+	old_alloc = dnode->i_blocks / INOBLK;
+	new_alloc = calc_file_alloc_blocks((unsigned long) nblocks * BLOCKSIZE);
+	if (!nents || !parent || nidx > root_limit || new_alloc < 0
+	    || (unsigned long) new_alloc > fs->sb->s_free_blocks_count + old_alloc) {
+		put_nod(dni);
+		free(ents);
+		free(names);
+		return 0;
+	}
+
+	buf = calloc(nblocks, BLOCKSIZE);
+	hashes = calloc(nleaves, sizeof(*hashes));
+	if (!buf || !hashes)
+		error_msg_and_die("not enough memory for directory index");
+
+	// the leaves, after the root and the index blocks
+	p = buf + (1 + nidx) * BLOCKSIZE;
+	end = p + BLOCKSIZE;
+	for (i = 0, j = 0; i < nents; i++) {
+		uint32 reclen = sizeof(directory) + rndup(ents[i].nlen, 4);
+		if (p + reclen > end) {
+			j++;
+			p = end;
+			end = p + BLOCKSIZE;
+			hashes[j] = ents[i].hash;
+			if (ents[i].hash == ents[i-1].hash)
+				hashes[j] |= 1; // continued from the previous leaf
+		}
+		if (i + 1 == nents || p + reclen
+		    + sizeof(directory) + rndup(ents[i+1].nlen, 4) > end)
+			reclen = end - p;
+		p = dx_put_dir(fs, p, ents[i].nod, reclen, ents[i].name,
+			       ents[i].nlen);
+	}
+
+	// the root: "." and "..", whose record covers the index
+	p = dx_put_dir(fs, buf, dnod, 12, ".", 1);
+	dx_put_dir(fs, p, parent, BLOCKSIZE - 12, "..", 2);
+	p = buf + DX_ROOT_INFO_OFFSET;
+	dx_put32(fs, p, 0);
+	p[4] = DX_HASH_HALF_MD4;
+	p[5] = 8; // info length
+	p[6] = levels;
+	p[7] = 0;
+	if (!levels) {
+		dx_put_entries(fs, buf + DX_ROOT_ENTRIES_OFFSET, root_limit,
+			       nleaves, hashes, 1);
+	} else {
+		uint32 *nhashes = malloc(nidx * sizeof(*nhashes));
+
+		if (!nhashes)
+			error_msg_and_die("not enough memory for directory index");
+		for (i = 0; i < nidx; i++) {
+			uint32 first = i * node_limit;
+			uint32 count = nleaves - first < node_limit
+				? nleaves - first : node_limit;
+
+			p = buf + (1 + i) * BLOCKSIZE;
+			dx_put_dir(fs, p, 0, BLOCKSIZE, "", 0);
+			dx_put_entries(fs, p + DX_NODE_ENTRIES_OFFSET,
+				       node_limit, count, hashes + first,
+				       1 + nidx + first);
+			nhashes[i] = hashes[first];
+		}
+		dx_put_entries(fs, buf + DX_ROOT_ENTRIES_OFFSET, root_limit,
+			       nidx, nhashes, 1);
+		free(nhashes);
+	}
+
+	// replace the old blocks.  The free block count checked above
+	// includes them, but alloc_blk never scans below the hints, so
+	// move those back for the blocks freed here
+	fs->reuse_freed_blks = 1;
+	inode_pos_init(fs, &ipos, dnod, INODE_POS_TRUNCATE, NULL);
+	fs->reuse_freed_blks = 0;
+	// the freed indirect blocks may come back as data
+	if (cache_flush(&fs->blkmaps))
+		error_msg_and_die("entry mismatch on blockmap cache flush");
+	extend_inode_blk(fs, &ipos, buf, nblocks);
+	inode_pos_finish(fs, &ipos);
+	dnode->i_size = nblocks * BLOCKSIZE;
+	dnode->i_flags |= EXT2_INDEX_FL;
+	mark_nod_dirty(dni);
+	put_nod(dni);
+	// its blocks and their free space are not the ones indexed any more
+	dirindex_drop(fs, dnod);
+
+	free(buf);
+	free(hashes);
+	free(ents);
+	free(names);
+	return 1;
+}
+
+// Hash all the directories of more than one block, except lost+found
+// which is kept as it is for fsck.
+static void
+dx_index_dirs(filesystem *fs)
+{
+	uint32 *dirs = NULL, ndirs = 0, maxdirs = 0;
+	uint32 grp, nbgroups, i, nod, lpf;
+	groupdescriptor *gd;
+	gd_info *gi;
+	blk_info *bi;
+	nod_info *ni;
+	inode *node;
+	uint8 *ibm;
+
+	lpf = find_dir(fs, EXT2_ROOT_INO, "lost+found");
+	nbgroups = GRP_NBGROUPS(fs);
+	for (grp = 0; grp < nbgroups; grp++) {
+		gd = get_gd(fs, grp, &gi);
+		ibm = GRP_GET_GROUP_IBM(fs, gd, &bi);
+		for (i = bitmap_find_set(ibm, 0, fs->sb->s_inodes_per_group);
+		     i < fs->sb->s_inodes_per_group;
+		     i = bitmap_find_set(ibm, i + 1, fs->sb->s_inodes_per_group)) {
+			nod = grp * fs->sb->s_inodes_per_group + i + 1;
+			if (nod != EXT2_ROOT_INO && nod < EXT2_FIRST_INO)
+				continue;
+			if (nod == lpf)
+				continue;
+			node = get_nod(fs, nod, &ni);
+			if ((node->i_mode & FM_IFMT) == FM_IFDIR
+			    && node->i_size > BLOCKSIZE
+			    && !(node->i_flags & EXT2_INDEX_FL)) {
+				if (ndirs == maxdirs) {
+					maxdirs = maxdirs ? maxdirs * 2 : 64;
+					dirs = realloc(dirs, maxdirs * sizeof(*dirs));
+					if (!dirs)
+						error_msg_and_die("not enough memory for directory index");
+				}
+				dirs[ndirs++] = nod;
+			}
+			put_nod(ni);
+		}
+		GRP_PUT_GROUP_IBM(bi);
+		put_gd(gi);
+	}
+	for (i = 0; i < ndirs; i++)
+		fs->dx_dirs += dx_index_dir(fs, dirs[i]);
+	free(dirs);
+
+	fs->sb->s_feature_compat |= EXT2_FEATURE_COMPAT_DIR_INDEX;
+	fs->sb->s_def_hash_version = DX_HASH_HALF_MD4;
+	fs->sb->s_flags |= EXT2_FLAGS_UNSIGNED_HASH;
+}
+
+// make a file from a FILE*
+static uint32
+mkfile_fs(filesystem *fs, uint32 parent_nod, const char *name, uint32 mode, file_read_cb read_cb, void *data, off_t size, uid_t uid, gid_t gid, uint32 ctime, uint32 mtime)
+{
+	uint32 nod = mknod_fs(fs, parent_nod, name, mode|FM_IFREG, uid, gid, 0, 0, ctime, mtime);
+	nod_info *ni;
+	inode *node = get_nod(fs, nod, &ni);
+	off_t actual_size;
+	inode_pos ipos;
+	long need;
+
+	inode_pos_init(fs, &ipos, nod, INODE_POS_TRUNCATE, NULL);
+
+	// nothing else gets allocated while the data is written, so its
+	// blocks can be set aside at once
+	need = size > 0 ? calc_file_alloc_blocks(size) : 0;
+	if (need > 0)
+		reserve_blks(fs, nod, need);
+	actual_size = read_cb(fs, &ipos, size, data);
+	release_reserved_blks(fs);
+
+	if (actual_size > 0x7fffffff) {
+		if (fs->sb->s_rev_level < 1)
+			fs_upgrade_rev1_largefile(fs);
+		fs->sb->s_feature_ro_compat |= EXT2_FEATURE_RO_COMPAT_LARGE_FILE;
+	}
+	node->i_dir_acl = actual_size >> 32;
+	node->i_size = actual_size;
+	inode_pos_finish(fs, &ipos);
+	mark_nod_dirty(ni);
+	put_nod(ni);
+	return nod;
+}
+
+// retrieves a mode info from a struct stat
+static uint32
+get_mode(struct stat *st)
+{
+	uint32 mode = 0;
+
+	if(st->st_mode & S_IRUSR)
+		mode |= FM_IRUSR;
+	if(st->st_mode & S_IWUSR)
+		mode |= FM_IWUSR;
+	if(st->st_mode & S_IXUSR)
+		mode |= FM_IXUSR;
+	if(st->st_mode & S_IRGRP)
+		mode |= FM_IRGRP;
+	if(st->st_mode & S_IWGRP)
+		mode |= FM_IWGRP;
+	if(st->st_mode & S_IXGRP)
+		mode |= FM_IXGRP;
+	if(st->st_mode & S_IROTH)
+		mode |= FM_IROTH;
+	if(st->st_mode & S_IWOTH)
+		mode |= FM_IWOTH;
+	if(st->st_mode & S_IXOTH)
+		mode |= FM_IXOTH;
+	if(st->st_mode & S_ISUID)
+		mode |= FM_ISUID;
+	if(st->st_mode & S_ISGID)
+		mode |= FM_ISGID;
+	if(st->st_mode & S_ISVTX)
+		mode |= FM_ISVTX;
+	return mode;
+}
+
+#define OCTAL_READ(field) tar_numeric_field_read((unsigned char*)field, sizeof field)
 
-	// Need 3rd indirection
-	if(file_blocks / double_blocks <= (long)ADDR_PER_BLOCK)
+long long tar_numeric_field_read(unsigned char *field, size_t size)
+{
+	size_t i;
+	unsigned long long res = 0;
+	// this is the 256-based GNU extension
+	if(*field == 0x80 || *field == 0xff)
 	{
-		long indirect_blocks = 1 + (file_blocks + double_blocks - 1) / double_blocks
-		                         + (file_blocks + ADDR_PER_BLOCK - 1) / ADDR_PER_BLOCK;
-		final_file_blocks += file_blocks + indirect_blocks;
-		return final_file_blocks;
-	}
+		if(*field == 0xff)
+			res = -1;
+		for(i = 1; i < size; i++)
+			res = (res << 8) + field[i];
+	} else
+		for(i = 0; i < size; i++)
+		{
+			char c = field[i];
+			if(c == ' ')
+				continue;
+			if(c < '0' || c > '7')
+				break;
+			res = 8 * res + c - '0';
+		}
+	return res;
+}
 
-	return -1;
+int is_zero(char *block, size_t size)
+{
+	size_t i;
+	for(i = 0; i < size; i++)
+		if(block[i])
+			return 0;
+	return 1;
 }
 
 static void
@@ -3256,231 +5237,757 @@ add2fs_from_file(filesystem *fs, uint32 this_nod, FILE * fh, uint32 fs_timestamp
 		free(path2);
 }
 
-// adds a tree of entries to the filesystem from current dir
+// One entry of a source directory, with all the population pass needs
+// of its metadata
+struct srcent {
+	char *name;
+	struct srcdir *dir;        // contents of a directory
+	char *link;                // symlink target, size bytes
+	char *xlist;               // xattr names, xitems point into it
+	struct xattr_item *xitems;
+	int xcount;
+	int xlisted;               // llistxattr found some names
+	uint32 prefetch;           // 1 + index in the read ahead queue, or 0
+	uint32 type;               // st_mode & S_IFMT
+	uint32 mode;
+	uint32 uid;
+	uint32 gid;
+	uint32 mtime;
+	nlink_t nlink;
+	off_t size;
+	dev_t dev;
+	dev_t rdev;
+	ino_t ino;
+};
+
+// A source directory as scan_dir read it, in scandir order.  The
+// sizing pass builds it and the population pass consumes it, so the
+// source tree is only listed and stat'ed once.
+struct srcdir {
+	int nents;
+	struct srcent ents[];
+};
+
+#if HAVE_LLISTXATTR
 static void
-add2fs_from_dir(filesystem *fs, uint32 this_nod, int squash_uids, int squash_perms, int copy_xattrs, uint32 fs_timestamp, struct stats *stats)
+read_xattrs(struct srcent *se, const char *path)
 {
-	uint32 nod;
-	uint32 uid, gid, mode, ctime, mtime;
-	const char *name;
-	FILE *fh;
-	struct dirent **dents = NULL;
-	struct stat st;
-	char *lnk;
-	uint32 save_nod;
-	int numdirs, i;
-	off_t filesize;
+	ssize_t xlist_size = llistxattr(path, NULL, 0);
+	char *p;
+	int xi;
 
-	if((numdirs = scandir(".", &dents, NULL, alphasort)) == -1)
-		perror_msg_and_die(".");
-	for (i = 0; i < numdirs; ++i)
+	if (xlist_size <= 0)
+		return;
+	se->xlisted = 1;
+	se->xlist = malloc(xlist_size);
+	if (!se->xlist)
+		error_msg_and_die(memory_exhausted);
+	xlist_size = llistxattr(path, se->xlist, xlist_size);
+	if (xlist_size <= 0)
+		return;
+
+	// count xattrs
+	for (p = se->xlist; p < se->xlist + xlist_size; p += strlen(p) + 1)
+		se->xcount++;
+	se->xitems = calloc(se->xcount, sizeof(struct xattr_item));
+	if (!se->xitems)
+		error_msg_and_die(memory_exhausted);
+
+	// read each xattr value
+	xi = 0;
+	for (p = se->xlist; p < se->xlist + xlist_size; p += strlen(p) + 1) {
+		ssize_t val_size = lgetxattr(path, p, NULL, 0);
+		if (val_size < 0)
+			continue;
+		se->xitems[xi].name = p;
+		if (val_size > 0) {
+			void *val = malloc(val_size);
+			if (!val)
+				error_msg_and_die(memory_exhausted);
+			if (lgetxattr(path, p, val, val_size) != val_size) {
+				free(val);
+				continue;
+			}
+			se->xitems[xi].value = val;
+		} else {
+			se->xitems[xi].value = NULL;
+		}
+		se->xitems[xi].value_len = val_size;
+		xi++;
+	}
+	se->xcount = xi;
+}
+#endif
+
+static void
+free_srcdir(struct srcdir *sd)
+{
+	struct srcent *se;
+	int i, j;
+
+	for (i = 0; i < sd->nents; i++) {
+		se = &sd->ents[i];
+		if (se->dir)
+			free_srcdir(se->dir);
+		for (j = 0; j < se->xcount; j++)
+			free((void *)se->xitems[j].value);
+		free(se->xitems);
+		free(se->xlist);
+		free(se->link);
+		free(se->name);
+	}
+	free(sd);
+}
+
+// Counts what a scanned tree will take in the filesystem
+static void
+srcdir_stats(struct srcdir *sd, struct stats *stats)
+{
+	struct srcent *se;
+	int i;
+
+	for (i = 0; i < sd->nents; i++)
+	{
+		se = &sd->ents[i];
+		switch(se->type)
+		{
+			case S_IFLNK:
+				if(se->size >= 4 * (EXT2_TIND_BLOCK+1))
+					stats->nblocks += (se->size + BLOCKSIZE - 1) / BLOCKSIZE;
+				stats->ninodes++;
+				if(se->xlisted)
+					stats->nblocks++;
+				break;
+			case S_IFREG:
+			{
+				int total_blocks = calc_file_alloc_blocks(se->size);
+				if(total_blocks == -1)
+					error_msg_and_die("%s: file too large", se->name);
+				stats->nblocks += total_blocks;
+				// Fall through
+			}
+			case S_IFCHR:
+			case S_IFBLK:
+			case S_IFIFO:
+			case S_IFSOCK:
+				stats->ninodes++;
+				if(se->xlisted)
+					stats->nblocks++;
+				break;
+			case S_IFDIR:
+				stats->ninodes++;
+				stats->nblocks++; // each directory uses at least 1 block
+				if(se->xlisted)
+					stats->nblocks++;
+				srcdir_stats(se->dir, stats);
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+// A directory waiting to be read
+struct scanjob {
+	struct scanjob *next;
+	struct srcdir **dir;       // where to put what was read
+	char path[];               // from the top of the tree, "" for it
+};
+
+// The directories of a tree are read by a few threads that take them
+// from a shared stack, each pushing the subdirectories it finds.  Every
+// directory is sorted on its own, so the result does not depend on
+// which thread read what.
+struct scanner {
+	int rootfd;
+	int copy_xattrs;
+	struct scanjob *jobs;
+	unsigned long pending;     // jobs on the stack or being read
+#if HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+};
+
+static void
+scan_push(struct scanner *sc, struct srcdir **dir, const char *path,
+	  const char *name)
+{
+	struct scanjob *job;
+	size_t plen = strlen(path);
+
+	job = malloc(sizeof(*job) + plen + strlen(name) + 2);
+	if (!job)
+		error_msg_and_die(memory_exhausted);
+	job->dir = dir;
+	if (plen)
+		sprintf(job->path, "%s/%s", path, name);
+	else
+		strcpy(job->path, name);
+#if HAVE_PTHREAD_H
+	pthread_mutex_lock(&sc->lock);
+#endif
+	job->next = sc->jobs;
+	sc->jobs = job;
+	sc->pending++;
+#if HAVE_PTHREAD_H
+	pthread_cond_signal(&sc->cond);
+	pthread_mutex_unlock(&sc->lock);
+#endif
+}
+
+// same order as scandir with alphasort
+static int
+scan_name_cmp(const void *a, const void *b)
+{
+	return strcoll(*(char * const *)a, *(char * const *)b);
+}
+
+static struct srcdir *
+scan_one_dir(struct scanner *sc, const char *path)
+{
+	struct srcdir *sd;
+	struct srcent *se;
+	struct stat st;
+	struct dirent *dent;
+	DIR *d;
+	char **names = NULL, *epath = NULL;
+	int fd, n = 0, size = 0, i;
+
+	if ((fd = openat(sc->rootfd, *path ? path : ".", O_RDONLY | O_DIRECTORY)) < 0
+	    || !(d = fdopendir(fd)))
+		perror_msg_and_die("%s", *path ? path : ".");
+	while ((dent = readdir(d)))
 	{
-		struct dirent *dent = dents[i];
 		if((!strcmp(dent->d_name, ".")) || (!strcmp(dent->d_name, "..")))
 			continue;
-		lstat(dent->d_name, &st);
-		uid = st.st_uid;
-		gid = st.st_gid;
-		ctime = fs_timestamp;
-		mtime = st.st_mtime;
-		name = dent->d_name;
-		mode = get_mode(&st);
-		if(squash_uids)
-			uid = gid = 0;
-		if(squash_perms)
-			mode &= ~(FM_IRWXG | FM_IRWXO);
-		if(stats)
-			switch(st.st_mode & S_IFMT)
-			{
-				case S_IFLNK:
-					if(st.st_size >= 4 * (EXT2_TIND_BLOCK+1))
-						stats->nblocks += (st.st_size + BLOCKSIZE - 1) / BLOCKSIZE;
-					stats->ninodes++;
-#if HAVE_LLISTXATTR
-					if(copy_xattrs && llistxattr(dent->d_name, NULL, 0) > 0)
-						stats->nblocks++;
+		if (n == size) {
+			size = size ? size * 2 : 16;
+			names = realloc(names, size * sizeof(*names));
+			if (!names)
+				error_msg_and_die(memory_exhausted);
+		}
+		names[n++] = xstrdup(dent->d_name);
+	}
+	qsort(names, n, sizeof(*names), scan_name_cmp);
+	sd = malloc(sizeof(*sd) + n * sizeof(*se));
+	if (!sd)
+		error_msg_and_die(memory_exhausted);
+	sd->nents = n;
+	for (i = 0; i < n; i++)
+	{
+		se = &sd->ents[i];
+		memset(se, 0, sizeof(*se));
+		se->name = names[i];
+		// the path is only needed for messages and xattrs
+		free(epath);
+		epath = malloc(strlen(path) + strlen(se->name) + 2);
+		if (!epath)
+			error_msg_and_die(memory_exhausted);
+		sprintf(epath, "%s%s%s", path, *path ? "/" : "", se->name);
+		if(fstatat(fd, se->name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+			perror_msg_and_die("%s", epath);
+		se->type = st.st_mode & S_IFMT;
+		se->mode = get_mode(&st);
+		se->uid = st.st_uid;
+		se->gid = st.st_gid;
+		se->mtime = st.st_mtime;
+		se->nlink = st.st_nlink;
+		se->size = st.st_size;
+		se->dev = st.st_dev;
+		se->ino = st.st_ino;
+#if HAVE_STRUCT_STAT_ST_RDEV
+		se->rdev = st.st_rdev;
 #endif
-					break;
-				case S_IFREG:
-				{
-					int total_blocks = calc_file_alloc_blocks(st.st_size);
-					if(total_blocks == -1)
-						error_msg_and_die("%s: file too large", dent->d_name);
-					stats->nblocks += total_blocks;
-					// Fall through
-				}
-				case S_IFCHR:
-				case S_IFBLK:
-				case S_IFIFO:
-				case S_IFSOCK:
-					stats->ninodes++;
 #if HAVE_LLISTXATTR
-					if(copy_xattrs && llistxattr(dent->d_name, NULL, 0) > 0)
-						stats->nblocks++;
+		if(sc->copy_xattrs)
+			read_xattrs(se, epath);
 #endif
-					break;
-				case S_IFDIR:
-					stats->ninodes++;
-					stats->nblocks++; // each directory uses at least 1 block
-#if HAVE_LLISTXATTR
-					if(copy_xattrs && llistxattr(dent->d_name, NULL, 0) > 0)
-						stats->nblocks++;
+		if(se->type == S_IFLNK)
+		{
+			// mklink_fs copies whole blocks, or all of i_block
+			// for a fast symlink
+			if(st.st_size < 4 * (EXT2_TIND_BLOCK+1))
+				se->link = calloc(1, 4 * (EXT2_TIND_BLOCK+1));
+			else
+				se->link = calloc(1, rndup(st.st_size, BLOCKSIZE));
+			if (se->link == NULL)
+				error_msg_and_die(memory_exhausted);
+			if (readlinkat(fd, se->name, se->link, st.st_size) <= 0)
+			{
+				error_msg("readlink: %s", epath);
+				free(se->link);
+				se->link = NULL;
+			}
+		}
+		else if(se->type == S_IFDIR)
+			scan_push(sc, &se->dir, path, se->name);
+	}
+	closedir(d);
+	free(epath);
+	free(names);
+	return sd;
+}
+
+static void *
+scan_worker(void *arg)
+{
+	struct scanner *sc = arg;
+	struct scanjob *job;
+
+	for (;;)
+	{
+#if HAVE_PTHREAD_H
+		pthread_mutex_lock(&sc->lock);
+		while (!sc->jobs && sc->pending)
+			pthread_cond_wait(&sc->cond, &sc->lock);
+#endif
+		if ((job = sc->jobs))
+			sc->jobs = job->next;
+#if HAVE_PTHREAD_H
+		pthread_mutex_unlock(&sc->lock);
+#endif
+		if (!job)
+			break;
+		*job->dir = scan_one_dir(sc, job->path);
+		free(job);
+#if HAVE_PTHREAD_H
+		pthread_mutex_lock(&sc->lock);
+		if (!--sc->pending)
+			pthread_cond_broadcast(&sc->cond);
+		pthread_mutex_unlock(&sc->lock);
+#else
+		sc->pending--;
+#endif
+	}
+	return NULL;
+}
+
+// reads the tree under the current dir with nthreads threads, and
+// counts what it will take in the filesystem when stats is given
+static struct srcdir *
+scan_dir(int copy_xattrs, int nthreads, struct stats *stats)
+{
+	struct scanner sc;
+	struct srcdir *sd = NULL;
+#if HAVE_PTHREAD_H
+	pthread_t *threads;
+	int i, started = 0;
+#endif
+
+	if ((sc.rootfd = open(".", O_RDONLY | O_DIRECTORY)) < 0)
+		perror_msg_and_die(".");
+	sc.copy_xattrs = copy_xattrs;
+	sc.jobs = NULL;
+	sc.pending = 0;
+#if HAVE_PTHREAD_H
+	pthread_mutex_init(&sc.lock, NULL);
+	pthread_cond_init(&sc.cond, NULL);
+#endif
+	scan_push(&sc, &sd, "", "");
+#if HAVE_PTHREAD_H
+	// this thread is one of them
+	threads = calloc(nthreads, sizeof(*threads));
+	if (!threads)
+		error_msg_and_die(memory_exhausted);
+	for (i = 1; i < nthreads; i++)
+		if (!pthread_create(&threads[started], NULL, scan_worker, &sc))
+			started++;
+	scan_worker(&sc);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_cond_destroy(&sc.cond);
+	pthread_mutex_destroy(&sc.lock);
+#else
+	scan_worker(&sc);
+#endif
+	close(sc.rootfd);
+	if (stats)
+		srcdir_stats(sd, stats);
+	return sd;
+}
+
+// Regular files are read ahead of the population pass by a few
+// threads, in the order add2fs_from_dir will want them, so that the
+// reads overlap with the allocation and copying of the files before.
+// The readers stay at most PREFETCH_FILES files and PREFETCH_BYTES
+// bytes ahead; files larger than PREFETCH_FILE_MAX are only opened and
+// are read while they are copied, like without read ahead.
+
+#define PREFETCH_FILES 64
+#define PREFETCH_BYTES (32 << 20)
+#define PREFETCH_FILE_MAX (1 << 20)
+
+struct prefetch_file {
+	struct srcent *se;
+	char *path;                // from the top of the tree
+	int fd;                    // -1 when it could not be opened
+	int ready;
+	struct fbuf buf;           // contents, if they were read
+};
+
+struct prefetcher {
+	int rootfd;
+	struct prefetch_file *files;
+	uint32 nfiles;
+	uint32 size;
+	uint32 next_read;          // next file for a reader
+	uint32 next_use;           // files before this one were used
+	size_t inflight;           // bytes read and not used yet
+	int stop;
+#if HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+	pthread_cond_t ready;      // a file was read
+	pthread_cond_t room;       // a file was used, readers may go on
+	pthread_t *threads;
+	int nthreads;
+#endif
+};
+
+#if HAVE_PTHREAD_H
+// queues the regular files of sd in population order, except links to
+// files that are already queued or copied
+static void
+prefetch_queue(filesystem *fs, struct prefetcher *pf, struct hdlinks_s *seen,
+	       struct srcdir *sd, const char *path)
+{
+	struct srcent *se;
+	struct prefetch_file *f;
+	char *epath;
+	int i;
+
+	for (i = 0; i < sd->nents; i++)
+	{
+		se = &sd->ents[i];
+		if (se->type != S_IFREG && se->type != S_IFDIR)
+			continue;
+		epath = malloc(strlen(path) + strlen(se->name) + 2);
+		if (!epath)
+			error_msg_and_die(memory_exhausted);
+		sprintf(epath, "%s%s%s", path, *path ? "/" : "", se->name);
+		if (se->type == S_IFDIR) {
+			prefetch_queue(fs, pf, seen, se->dir, epath);
+			free(epath);
+			continue;
+		}
+		if (se->nlink > 1) {
+			if (is_hardlink(fs, se->dev, se->ino)
+			    || hdlinks_get(seen, se->dev, se->ino)) {
+				free(epath);
+				continue;
+			}
+			hdlinks_put(seen, se->dev, se->ino, 1);
+		}
+		if (pf->nfiles == pf->size) {
+			pf->size = pf->size ? pf->size * 2 : 256;
+			pf->files = realloc(pf->files, pf->size * sizeof(*pf->files));
+			if (!pf->files)
+				error_msg_and_die(memory_exhausted);
+		}
+		f = &pf->files[pf->nfiles++];
+		memset(f, 0, sizeof(*f));
+		f->se = se;
+		f->path = epath;
+		f->fd = -1;
+		se->prefetch = pf->nfiles;
+	}
+}
+
+static void
+prefetch_read(struct prefetcher *pf, struct prefetch_file *f)
+{
+	size_t size = f->se->size;
+	ssize_t r;
+
+	if ((f->fd = openat(pf->rootfd, f->path, O_RDONLY)) < 0)
+		return;
+	if (size > PREFETCH_FILE_MAX)
+		return;
+	f->buf.data = calloc(1, size ? rndup(size, BLOCKSIZE) : 1);
+	if (!f->buf.data)
+		error_msg_and_die(memory_exhausted);
+	while (f->buf.len < size) {
+		r = read(f->fd, f->buf.data + f->buf.len, size - f->buf.len);
+		if (r <= 0)
+			break;
+		f->buf.len += r;
+	}
+	close(f->fd);
+	f->fd = -1;
+}
+
+static void *
+prefetch_worker(void *arg)
+{
+	struct prefetcher *pf = arg;
+	struct prefetch_file *f;
+
+	pthread_mutex_lock(&pf->lock);
+	for (;;)
+	{
+		// the file add2fs_from_dir waits for is always taken
+		while (!pf->stop && pf->next_read < pf->nfiles
+		       && pf->next_read > pf->next_use
+		       && (pf->next_read - pf->next_use >= PREFETCH_FILES
+			   || pf->inflight >= PREFETCH_BYTES))
+			pthread_cond_wait(&pf->room, &pf->lock);
+		if (pf->stop || pf->next_read == pf->nfiles)
+			break;
+		f = &pf->files[pf->next_read++];
+		if (f->se->size <= PREFETCH_FILE_MAX)
+			pf->inflight += f->se->size;
+		pthread_mutex_unlock(&pf->lock);
+		prefetch_read(pf, f);
+		pthread_mutex_lock(&pf->lock);
+		f->ready = 1;
+		pthread_cond_signal(&pf->ready);
+	}
+	pthread_mutex_unlock(&pf->lock);
+	return NULL;
+}
+
+// starts reading the files of the tree under the current dir
+static struct prefetcher *
+prefetch_start(filesystem *fs, struct srcdir *sd, int nthreads)
+{
+	struct prefetcher *pf;
+	struct hdlinks_s seen;
+	int i;
+
+	pf = calloc(1, sizeof(*pf));
+	if (!pf)
+		error_msg_and_die(memory_exhausted);
+	memset(&seen, 0, sizeof(seen));
+	prefetch_queue(fs, pf, &seen, sd, "");
+	free(seen.hdl);
+	if ((pf->rootfd = open(".", O_RDONLY | O_DIRECTORY)) < 0)
+		perror_msg_and_die(".");
+	pthread_mutex_init(&pf->lock, NULL);
+	pthread_cond_init(&pf->ready, NULL);
+	pthread_cond_init(&pf->room, NULL);
+	pf->threads = calloc(nthreads, sizeof(*pf->threads));
+	if (!pf->threads)
+		error_msg_and_die(memory_exhausted);
+	for (i = 0; i < nthreads; i++)
+		if (!pthread_create(&pf->threads[pf->nthreads], NULL,
+				    prefetch_worker, pf))
+			pf->nthreads++;
+	return pf;
+}
+
+static void
+prefetch_release(struct prefetcher *pf, struct prefetch_file *f)
+{
+	if (f->se->size <= PREFETCH_FILE_MAX)
+		pf->inflight -= f->se->size;
+	if (f->fd >= 0)
+		close(f->fd);
+	f->fd = -1;
+	free(f->buf.data);
+	f->buf.data = NULL;
+	free(f->path);
+	f->path = NULL;
+}
+
+// the read ahead of se, NULL if it was not queued
+static struct prefetch_file *
+prefetch_get(struct prefetcher *pf, struct srcent *se)
+{
+	struct prefetch_file *f;
+	uint32 i;
+
+	if (!pf || !se->prefetch || !pf->nthreads)
+		return NULL;
+	i = se->prefetch - 1;
+	pthread_mutex_lock(&pf->lock);
+	// files skipped by add2fs_from_dir, duplicates of earlier layers
+	for (; pf->next_use < i; pf->next_use++) {
+		f = &pf->files[pf->next_use];
+		while (!f->ready)
+			pthread_cond_wait(&pf->ready, &pf->lock);
+		prefetch_release(pf, f);
+	}
+	pthread_cond_broadcast(&pf->room);
+	f = &pf->files[i];
+	while (!f->ready)
+		pthread_cond_wait(&pf->ready, &pf->lock);
+	pthread_mutex_unlock(&pf->lock);
+	return f;
+}
+
+static void
+prefetch_done(struct prefetcher *pf, struct prefetch_file *f)
+{
+	pthread_mutex_lock(&pf->lock);
+	prefetch_release(pf, f);
+	pf->next_use = f - pf->files + 1;
+	pthread_cond_broadcast(&pf->room);
+	pthread_mutex_unlock(&pf->lock);
+}
+
+static void
+prefetch_stop(struct prefetcher *pf)
+{
+	uint32 i;
+	int t;
+
+	pthread_mutex_lock(&pf->lock);
+	pf->stop = 1;
+	pthread_cond_broadcast(&pf->room);
+	pthread_mutex_unlock(&pf->lock);
+	for (t = 0; t < pf->nthreads; t++)
+		pthread_join(pf->threads[t], NULL);
+	for (i = 0; i < pf->nfiles; i++) {
+		pf->files[i].se->prefetch = 0;
+		prefetch_release(pf, &pf->files[i]);
+	}
+	pthread_cond_destroy(&pf->ready);
+	pthread_cond_destroy(&pf->room);
+	pthread_mutex_destroy(&pf->lock);
+	close(pf->rootfd);
+	free(pf->threads);
+	free(pf->files);
+	free(pf);
+}
+#else
+static struct prefetcher *
+prefetch_start(filesystem *fs, struct srcdir *sd, int nthreads)
+{
+	return NULL;
+}
+
+static struct prefetch_file *
+prefetch_get(struct prefetcher *pf, struct srcent *se)
+{
+	return NULL;
+}
+
+static void
+prefetch_done(struct prefetcher *pf, struct prefetch_file *f)
+{
+}
+
+static void
+prefetch_stop(struct prefetcher *pf)
+{
+}
 #endif
-					if(chdir(dent->d_name) < 0)
-						perror_msg_and_die(dent->d_name);
-					add2fs_from_dir(fs, this_nod, squash_uids, squash_perms, copy_xattrs, fs_timestamp, stats);
-					if (chdir("..") == -1)
-						perror_msg_and_die("..");
 
-					break;
-				default:
-					break;
-			}
-		else
+// adds a tree of entries to the filesystem from the dir open at dfd,
+// as scan_dir read it.  Files and subdirectories are opened relative to
+// dfd, so the current dir stays the root of the layer, which the
+// xattr reads of the scanner and the paths of the prefetcher are
+// relative to.
+static void
+add2fs_from_dir(filesystem *fs, int dfd, uint32 this_nod, struct srcdir *sd, struct prefetcher *pf, int squash_uids, int squash_perms, uint32 fs_timestamp)
+{
+	uint32 nod;
+	uint32 uid, gid, mode, ctime, mtime;
+	const char *name;
+	FILE *fh;
+	struct srcent *se;
+	struct prefetch_file *pf_file;
+	uint32 save_nod;
+	int i, fd;
+
+	for (i = 0; i < sd->nents; ++i)
+	{
+		se = &sd->ents[i];
+		uid = se->uid;
+		gid = se->gid;
+		ctime = fs_timestamp;
+		mtime = se->mtime;
+		name = se->name;
+		mode = se->mode;
+		if(squash_uids)
+			uid = gid = 0;
+		if(squash_perms)
+			mode &= ~(FM_IRWXG | FM_IRWXO);
+		if((nod = find_dir(fs, this_nod, name)))
 		{
-			if((nod = find_dir(fs, this_nod, name)))
-			{
-				error_msg("ignoring duplicate entry %s", name);
-				if(S_ISDIR(st.st_mode)) {
-					if(chdir(dent->d_name) < 0)
-						perror_msg_and_die(name);
-					add2fs_from_dir(fs, nod, squash_uids, squash_perms, copy_xattrs, fs_timestamp, stats);
-					if (chdir("..") == -1)
-						perror_msg_and_die("..");
-				}
-				continue;
+			error_msg("ignoring duplicate entry %s", name);
+			if(se->type == S_IFDIR) {
+				if((fd = openat(dfd, name, O_RDONLY | O_DIRECTORY)) < 0)
+					perror_msg_and_die(name);
+				add2fs_from_dir(fs, fd, nod, se->dir, pf, squash_uids, squash_perms, fs_timestamp);
+				close(fd);
 			}
-			save_nod = 0;
-			/* Check for hardlinks */
-			if (!S_ISDIR(st.st_mode) && !S_ISLNK(st.st_mode) && st.st_nlink > 1) {
-				int32 hdlink = is_hardlink(fs, st.st_ino);
-				if (hdlink >= 0) {
-					add2dir(fs, this_nod, fs->hdlinks.hdl[hdlink].dst_nod, name);
-					continue;
-				} else {
-					save_nod = 1;
-				}
+			continue;
+		}
+		save_nod = 0;
+		/* Check for hardlinks */
+		if (se->type != S_IFDIR && se->type != S_IFLNK && se->nlink > 1) {
+			uint32 hdlink = is_hardlink(fs, se->dev, se->ino);
+			if (hdlink) {
+				add2dir(fs, this_nod, hdlink, name);
+				fs->hdlinks.links++;
+				continue;
+			} else {
+				save_nod = 1;
 			}
-			switch(st.st_mode & S_IFMT)
-			{
+		}
+		switch(se->type)
+		{
 #if HAVE_STRUCT_STAT_ST_RDEV
-				case S_IFCHR:
-					nod = mknod_fs(fs, this_nod, name, mode|FM_IFCHR, uid, gid, major(st.st_rdev), minor(st.st_rdev), ctime, mtime);
-					break;
-				case S_IFBLK:
-					nod = mknod_fs(fs, this_nod, name, mode|FM_IFBLK, uid, gid, major(st.st_rdev), minor(st.st_rdev), ctime, mtime);
-					break;
+			case S_IFCHR:
+				nod = mknod_fs(fs, this_nod, name, mode|FM_IFCHR, uid, gid, major(se->rdev), minor(se->rdev), ctime, mtime);
+				break;
+			case S_IFBLK:
+				nod = mknod_fs(fs, this_nod, name, mode|FM_IFBLK, uid, gid, major(se->rdev), minor(se->rdev), ctime, mtime);
+				break;
 #endif
-				case S_IFIFO:
-					nod = mknod_fs(fs, this_nod, name, mode|FM_IFIFO, uid, gid, 0, 0, ctime, mtime);
-					break;
-				case S_IFSOCK:
-					nod = mknod_fs(fs, this_nod, name, mode|FM_IFSOCK, uid, gid, 0, 0, ctime, mtime);
-					break;
-				case S_IFLNK:
-					lnk = calloc(1, rndup(st.st_size, BLOCKSIZE));
-					if (lnk == NULL)
-						error_msg_and_die(memory_exhausted);
-					if (readlink(dent->d_name, lnk, st.st_size) > 0)
-						nod = mklink_fs(fs, this_nod, name, st.st_size, (uint8*)lnk, uid, gid, ctime, mtime);
-					else
-						error_msg("readlink: %s", dent->d_name);
-					free(lnk);
-					break;
-				case S_IFREG:
-					fh = fopen(dent->d_name, "rb");
-					fseek(fh, 0, SEEK_END);
-					filesize = ftell(fh);
-					rewind(fh);
-					if (!fh) {
-						error_msg("Unable to open file %s", dent->d_name);
-						break;
-					}
-					nod = mkfile_fs(fs, this_nod, name, mode, fh_read, fh, filesize, uid, gid, ctime, mtime);
-					fclose(fh);
-					break;
-				case S_IFDIR:
-					nod = mkdir_fs(fs, this_nod, name, mode, uid, gid, ctime, mtime);
-					if(chdir(dent->d_name) < 0)
-						perror_msg_and_die(name);
-					add2fs_from_dir(fs, nod, squash_uids, squash_perms, copy_xattrs, fs_timestamp, stats);
-					if (chdir("..") == -1)
-						perror_msg_and_die("..");
+			case S_IFIFO:
+				nod = mknod_fs(fs, this_nod, name, mode|FM_IFIFO, uid, gid, 0, 0, ctime, mtime);
+				break;
+			case S_IFSOCK:
+				nod = mknod_fs(fs, this_nod, name, mode|FM_IFSOCK, uid, gid, 0, 0, ctime, mtime);
+				break;
+			case S_IFLNK:
+				if (se->link)
+					nod = mklink_fs(fs, this_nod, name, se->size, (uint8*)se->link, uid, gid, ctime, mtime);
+				break;
+			case S_IFREG:
+				if ((pf_file = prefetch_get(pf, se))) {
+					if (pf_file->buf.data) {
+						nod = mkfile_fs(fs, this_nod, name, mode, buf_read, &pf_file->buf, se->size, uid, gid, ctime, mtime);
+						fs->prefetch_files++;
+						fs->prefetch_bytes += pf_file->buf.len;
+					} else if (pf_file->fd >= 0 && (fh = fdopen(pf_file->fd, "rb"))) {
+						pf_file->fd = -1;
+						nod = mkfile_fs(fs, this_nod, name, mode, fh_copy, fh, se->size, uid, gid, ctime, mtime);
+						fclose(fh);
+					} else
+						error_msg("Unable to open file %s", name);
+					prefetch_done(pf, pf_file);
 					break;
-				default:
-					error_msg("ignoring entry %s", name);
-			}
-			if (save_nod) {
-				if (fs->hdlinks.count == fs->hdlink_cnt) {
-					if ((fs->hdlinks.hdl =
-						 realloc (fs->hdlinks.hdl, (fs->hdlink_cnt + HDLINK_CNT) *
-								  sizeof (struct hdlink_s))) == NULL) {
-						error_msg_and_die("Not enough memory");
-					}
-					fs->hdlink_cnt += HDLINK_CNT;
 				}
-				fs->hdlinks.hdl[fs->hdlinks.count].src_inode = st.st_ino;
-				fs->hdlinks.hdl[fs->hdlinks.count].dst_nod = nod;
-				fs->hdlinks.count++;
-			}
-#if HAVE_LLISTXATTR
-			// read and set xattrs from host file
-			if (copy_xattrs && nod) {
-				ssize_t xlist_size = llistxattr(dent->d_name, NULL, 0);
-				if (xlist_size > 0) {
-					char *xlist = malloc(xlist_size);
-					if (!xlist)
-						error_msg_and_die(memory_exhausted);
-					xlist_size = llistxattr(dent->d_name, xlist, xlist_size);
-					if (xlist_size > 0) {
-						int xcount = 0;
-						char *p;
-						struct xattr_item *xitems;
-						int xi;
-
-						// count xattrs
-						for (p = xlist; p < xlist + xlist_size; p += strlen(p) + 1)
-							xcount++;
-						xitems = calloc(xcount, sizeof(struct xattr_item));
-						if (!xitems)
-							error_msg_and_die(memory_exhausted);
-
-						// read each xattr value
-						xi = 0;
-						for (p = xlist; p < xlist + xlist_size; p += strlen(p) + 1) {
-							ssize_t val_size = lgetxattr(dent->d_name, p, NULL, 0);
-							if (val_size < 0)
-								continue;
-							xitems[xi].name = p;
-							if (val_size > 0) {
-								void *val = malloc(val_size);
-								if (!val)
-									error_msg_and_die(memory_exhausted);
-								if (lgetxattr(dent->d_name, p, val, val_size) != val_size) {
-									free(val);
-									continue;
-								}
-								xitems[xi].value = val;
-							} else {
-								xitems[xi].value = NULL;
-							}
-							xitems[xi].value_len = val_size;
-							xi++;
-						}
-						if (xi > 0)
-							set_xattrs(fs, nod, xitems, xi);
-						{ int j; for (j = 0; j < xi; j++)
-							free((void *)xitems[j].value); }
-						free(xitems);
-					}
-					free(xlist);
+				fd = openat(dfd, name, O_RDONLY);
+				if (fd < 0 || !(fh = fdopen(fd, "rb"))) {
+					if (fd >= 0)
+						close(fd);
+					error_msg("Unable to open file %s", name);
+					break;
 				}
-			}
-#endif
+				nod = mkfile_fs(fs, this_nod, name, mode, fh_copy, fh, se->size, uid, gid, ctime, mtime);
+				fclose(fh);
+				break;
+			case S_IFDIR:
+				nod = mkdir_fs(fs, this_nod, name, mode, uid, gid, ctime, mtime);
+				if((fd = openat(dfd, name, O_RDONLY | O_DIRECTORY)) < 0)
+					perror_msg_and_die(name);
+				add2fs_from_dir(fs, fd, nod, se->dir, pf, squash_uids, squash_perms, fs_timestamp);
+				close(fd);
+				break;
+			default:
+				error_msg("ignoring entry %s", name);
 		}
-		free(dent);
+		if (save_nod)
+			add_hardlink(fs, se->dev, se->ino, nod);
+		// xattrs read from host file
+		if (se->xcount && nod)
+			set_xattrs(fs, nod, se->xitems, se->xcount);
 	}
-	free(dents);
 }
 
 // Copy size blocks from src to dst, putting holes in the output
@@ -3513,6 +6020,92 @@ copy_file(filesystem *fs, FILE *dst, FILE *src, size_t size)
 	free(b);
 }
 
+#define STREAM_CHUNK (1024 * 1024)
+
+static void
+write_all(int fd, const uint8 *b, size_t size)
+{
+	ssize_t n;
+
+	while (size > 0) {
+		n = write(fd, b, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror_msg_and_die("write image");
+		}
+		b += n;
+		size -= n;
+	}
+}
+
+// Send the finished image to out.  A mapped image is written straight
+// from the mapping, otherwise it is read back in large chunks.
+//
+// This is not streaming: the image has to be complete first.  Writing
+// it out as it is built would need every inode and block placed before
+// the first write, and the sizing pass only counts them; directories,
+// block maps and xattr blocks are laid out while populating.
+static void
+stream_fs(filesystem *fs, FILE *out)
+{
+	off_t pos, size = ((off_t) fs->sb->s_blocks_count) * BLOCKSIZE;
+	size_t len;
+	ssize_t n;
+	uint8 *b;
+
+	if (fflush(out))
+		perror_msg_and_die("fflush");
+	if (fs->map) {
+		write_all(fileno(out), fs->map, fs->mapsize);
+		return;
+	}
+	b = malloc(STREAM_CHUNK);
+	if (!b)
+		error_msg_and_die("stream_fs: out of memory");
+	for (pos = 0; pos < size; pos += n) {
+		len = STREAM_CHUNK;
+		if ((off_t) len > size - pos)
+			len = size - pos;
+		n = pread(fileno(fs->f), b, len, pos);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n <= 0)
+			perror_msg_and_die("stream_fs: read");
+		write_all(fileno(out), b, n);
+	}
+	free(b);
+}
+
+// If stdout is a regular file open for reading and writing, and we're
+// at its start, the image can be built right there.
+static FILE *
+stdout_image(void)
+{
+	struct stat st;
+	int flags, fd;
+	FILE *f;
+
+	if (fstat(STDOUT_FILENO, &st) || !S_ISREG(st.st_mode))
+		return NULL;
+	flags = fcntl(STDOUT_FILENO, F_GETFL);
+	if (flags < 0 || (flags & O_ACCMODE) != O_RDWR)
+		return NULL;
+	if (lseek(STDOUT_FILENO, 0, SEEK_CUR) != 0)
+		return NULL;
+	if ((fd = dup(STDOUT_FILENO)) < 0)
+		return NULL;
+	if (!(f = fdopen(fd, "r+b")))
+		close(fd);
+	return f;
+}
+
+// objects allocated at once by the pools
+#define POOL_SLAB_OBJS 256
+#define POOL_SLAB_BUFS 64
+
 // Allocate a new filesystem structure, allocate internal memory,
 // and initialize the contents.
 static filesystem *
@@ -3526,21 +6119,39 @@ alloc_fs(int swapit, char *fname, uint32 nbblocks, FILE *srcfile)
 		error_msg_and_die("not enough memory for filesystem");
 	memset(fs, 0, sizeof(*fs));
 	fs->swapit = swapit;
-	cache_init(&fs->blks, MAX_FREE_CACHE_BLOCKS, blk_elem_val, blk_freed);
-	cache_init(&fs->gds, MAX_FREE_CACHE_GDS, gd_elem_val, gd_freed);
-	cache_init(&fs->blkmaps, MAX_FREE_CACHE_BLOCKMAPS,
-		   blkmap_elem_val, blkmap_freed);
-	cache_init(&fs->inodes, MAX_FREE_CACHE_INODES,
-		   inode_elem_val, inode_freed);
-	fs->hdlink_cnt = HDLINK_CNT;
-	fs->hdlinks.hdl = calloc(sizeof(struct hdlink_s), fs->hdlink_cnt);
-	if (!fs->hdlinks.hdl)
-		error_msg_and_die("Not enough memory");
-	fs->hdlinks.count = 0 ;
-
-	if (strcmp(fname, "-") == 0)
-		fs->f = tmpfile();
-	else if (srcfile) {
+	if (cache_init(&fs->blks, MAX_FREE_CACHE_BLOCKS, blk_elem_val, blk_freed)
+	    || cache_init(&fs->gds, MAX_FREE_CACHE_GDS, gd_elem_val, gd_freed)
+	    || cache_init(&fs->blkmaps, MAX_FREE_CACHE_BLOCKMAPS,
+			  blkmap_elem_val, blkmap_freed)
+	    || cache_init(&fs->inodes, MAX_FREE_CACHE_INODES,
+			  inode_elem_val, inode_freed))
+		error_msg_and_die("not enough memory for filesystem");
+	cache_set_batch(&fs->blks, blk_freed_batch);
+	pool_init(&fs->blk_pool, sizeof(blk_info), POOL_SLAB_OBJS);
+	pool_init(&fs->buf_pool, BLOCKSIZE, POOL_SLAB_BUFS);
+	pool_init(&fs->gd_pool, sizeof(gd_info), POOL_SLAB_OBJS);
+	pool_init(&fs->blkmap_pool, sizeof(blkmap_info), POOL_SLAB_OBJS);
+	pool_init(&fs->nod_pool, sizeof(nod_info), POOL_SLAB_OBJS);
+
+	if (strcmp(fname, "-") == 0) {
+		// unless we can work on stdout itself, build in a
+		// temporary file and stream it out when done
+		if ((fs->f = stdout_image())) {
+			fs->in_stdout = 1;
+			// start from an empty file as with a named output,
+			// unless -x is reading this very file
+			if (srcfile && !fstat(fileno(srcfile), &srcstat)
+			    && !fstat(fileno(fs->f), &dststat)
+			    && srcstat.st_ino == dststat.st_ino
+			    && srcstat.st_dev == dststat.st_dev)
+				return fs;
+			if (!srcfile && ftruncate(fileno(fs->f), 0))
+				perror_msg_and_die("truncating stdout");
+		} else
+			fs->f = tmpfile();
+		if (fs->f && srcfile)
+			copy_file(fs, fs->f, srcfile, nbblocks);
+	} else if (srcfile) {
 		if (fstat(fileno(srcfile), &srcstat))
 			perror_msg_and_die("fstat srcfile");
 		if (stat(fname, &dststat) == 0
@@ -3562,13 +6173,69 @@ alloc_fs(int swapit, char *fname, uint32 nbblocks, FILE *srcfile)
 	return fs;
 }
 
+// Map the output image, if possible.  From now on all accesses to the
+// image go through the mapping.  The whole file is allocated first:
+// a store to a page the filesystem has no room for raises SIGBUS,
+// where stdio gets an error it can report.  That would fill the holes
+// of a sparse image, which is left to stdio.
+static void
+map_fs(filesystem *fs, int sparse)
+{
+#if HAVE_MMAP && HAVE_POSIX_FALLOCATE
+	struct stat st;
+	off_t size = ((off_t) fs->sb->s_blocks_count) * BLOCKSIZE;
+	void *map;
+
+	if (!use_mmap)
+		return;
+	if (fstat(fileno(fs->f), &st) || !S_ISREG(st.st_mode))
+		return;
+	if ((off_t) (size_t) size != size)
+		return;
+	// an image with holes is meant to stay sparse
+	if (sparse)
+		return;
+	// out of space, or not supported there: stdio will do
+	if (posix_fallocate(fileno(fs->f), 0, size))
+		return;
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fileno(fs->f), 0);
+	if (map == MAP_FAILED)
+		return;
+	fs->map_bi = calloc(1, sizeof(*fs->map_bi));
+	if (!fs->map_bi)
+		error_msg_and_die("map_fs: out of memory");
+	fs->map_bi->fs = fs;
+	fs->map = map;
+	fs->mapsize = size;
+#endif
+}
+
+static void
+unmap_fs(filesystem *fs)
+{
+#if HAVE_MMAP
+	if (!fs->map)
+		return;
+	if (munmap(fs->map, fs->mapsize))
+		perror_msg_and_die("munmap");
+	fs->map = NULL;
+	free(fs->map_bi);
+	fs->map_bi = NULL;
+#endif
+}
+
 /* Make sure the output file is the right size */
 static void
-set_file_size(filesystem *fs)
+set_file_size(filesystem *fs, int sparse)
 {
+	// stdio isn't used on the image after this point
+	if (fflush(fs->f))
+		perror_msg_and_die("fflush");
 	if (ftruncate(fileno(fs->f),
 		      ((off_t) fs->sb->s_blocks_count) * BLOCKSIZE))
 		perror_msg_and_die("set_file_size: ftruncate");
+	map_fs(fs, sparse);
 }
 
 // initialize an empty filesystem
@@ -3583,7 +6250,6 @@ init_fs(int nbblocks, int nbinodes, int nbresrvd, int holes,
 	uint32 nbgroups,nbinodes_per_group,free_blocks,
 		nbblocks_per_group,min_nbgroups;
 	uint32 gdsz,itblsz;
-	uint32 j;
 	uint8 *bbm,*ibm;
 	inode *itab0;
 	blk_info *bi;
@@ -3672,7 +6338,7 @@ init_fs(int nbblocks, int nbinodes, int nbresrvd, int holes,
 	fs->sb->s_inode_size = EXT2_GOOD_OLD_INODE_SIZE;
 	fs->sb->s_feature_ro_compat = EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER;
 
-	set_file_size(fs);
+	set_file_size(fs, holes);
 
 	// set up groupdescriptors
 	for(i = 0; i < nbgroups; i++)
@@ -3712,6 +6378,7 @@ init_fs(int nbblocks, int nbinodes, int nbresrvd, int holes,
 		gd->bg_block_bitmap = bbmpos;
 		gd->bg_inode_bitmap = ibmpos;
 		gd->bg_inode_table = itblpos;
+		mark_gd_dirty(gi);
 		put_gd(gi);
 	}
 
@@ -3726,34 +6393,35 @@ init_fs(int nbblocks, int nbinodes, int nbresrvd, int holes,
 		gd = get_gd(fs, i, &gi);
 		bbm = GRP_GET_GROUP_BBM(fs, gd, &bi);
 		//non-filesystem blocks
-		for(j = gd->bg_free_blocks_count
-		        + grp_overhead + 1; j <= BLOCKSIZE * 8; j++)
-			allocate(bbm, j, NULL); 
+		bitmap_fill(bbm, gd->bg_free_blocks_count + grp_overhead,
+			    BLOCKSIZE * 8, 1);
 		//system blocks
-		for(j = 1; j <= grp_overhead; j++)
-			allocate(bbm, j, NULL); 
+		bitmap_fill(bbm, 0, grp_overhead, 1);
+		mark_blk_dirty(bi);
 		GRP_PUT_GROUP_BBM(bi);
 
 		/* Inode bitmap */
 		ibm = GRP_GET_GROUP_IBM(fs, gd, &bi);
 		//non-filesystem inodes
-		for(j = fs->sb->s_inodes_per_group+1; j <= BLOCKSIZE * 8; j++)
-			allocate(ibm, j, NULL);
+		bitmap_fill(ibm, fs->sb->s_inodes_per_group, BLOCKSIZE * 8, 1);
 
 		//system inodes
 		if(i == 0)
-			for(j = 1; j < EXT2_FIRST_INO; j++)
-				allocate(ibm, j, NULL);
+			bitmap_fill(ibm, 0, EXT2_FIRST_INO - 1, 1);
+		mark_blk_dirty(bi);
 		GRP_PUT_GROUP_IBM(bi);
 		put_gd(gi);
 	}
 
+	init_itbs(fs);
+
 	// make root inode and directory
 	/* We have groups now. Add the root filesystem in group 0 */
 	/* Also increment the directory count for group 0 */
 	gd = get_gd(fs, 0, &gi);
 	gd->bg_free_inodes_count--;
 	gd->bg_used_dirs_count = 1;
+	mark_gd_dirty(gi);
 	put_gd(gi);
 	itab0 = get_nod(fs, EXT2_ROOT_INO, &ni);
 	itab0->i_mode = FM_IFDIR | FM_IRWXU | FM_IRGRP | FM_IROTH | FM_IXGRP | FM_IXOTH;
@@ -3762,6 +6430,7 @@ init_fs(int nbblocks, int nbinodes, int nbresrvd, int holes,
 	itab0->i_atime = fs_timestamp;
 	itab0->i_size = BLOCKSIZE;
 	itab0->i_links_count = 2;
+	mark_nod_dirty(ni);
 	put_nod(ni);
 
 	new_dir(fs, EXT2_ROOT_INO, ".", 1, &dw);
@@ -3780,17 +6449,17 @@ init_fs(int nbblocks, int nbinodes, int nbresrvd, int holes,
 
 		nod = mkdir_fs(fs, EXT2_ROOT_INO, "lost+found", FM_IRWXU,
 			       0, 0, fs_timestamp, fs_timestamp);
-		b = get_workblk();
-		memset(b, 0, BLOCKSIZE);
+		b = get_workblk(fs);
 		((directory*)b)->d_rec_len = swapit ? swab16(BLOCKSIZE) : BLOCKSIZE;
 		inode_pos_init(fs, &ipos, nod, INODE_POS_EXTEND, NULL);
 		// It is always 16 blocks to start out with
 		for(i = 1; i < 16; i++)
 			extend_inode_blk(fs, &ipos, b, 1);
 		inode_pos_finish(fs, &ipos);
-		free_workblk(b);
+		free_workblk(fs, b);
 		node = get_nod(fs, nod, &ni);
 		node->i_size = 16 * BLOCKSIZE;
+		mark_nod_dirty(ni);
 		put_nod(ni);
 	}
 
@@ -3800,7 +6469,8 @@ init_fs(int nbblocks, int nbinodes, int nbresrvd, int holes,
 
 	// options for me
 	fs->holes = holes;
-	
+
+	load_groups(fs);
 	return fs;
 }
 
@@ -3841,7 +6511,8 @@ load_fs(FILE *fh, int swapit, char *fname)
 		if (fs->sb->s_inode_size != EXT2_GOOD_OLD_INODE_SIZE)
 			error_msg_and_die("inode size incompatible");
 		if (fs->sb->s_feature_compat
-		    & ~EXT2_FEATURE_COMPAT_EXT_ATTR)
+		    & ~(EXT2_FEATURE_COMPAT_EXT_ATTR
+			| EXT2_FEATURE_COMPAT_DIR_INDEX))
 			error_msg_and_die("Unsupported compat features");
 		if (fs->sb->s_feature_incompat)
 			error_msg_and_die("Unsupported incompat features");
@@ -3851,7 +6522,7 @@ load_fs(FILE *fh, int swapit, char *fname)
 			error_msg_and_die("Unsupported ro compat features");
 	}
 
-	set_file_size(fs);
+	set_file_size(fs, 0);
 
 	// allocation hint arrays for O(1) amortized block/inode allocation
 	{
@@ -3862,6 +6533,8 @@ load_fs(FILE *fh, int swapit, char *fname)
 			error_msg_and_die("error allocating allocation hint arrays");
 	}
 
+	init_itbs(fs);
+	load_groups(fs);
 	return fs;
 }
 
@@ -3871,6 +6544,24 @@ free_fs(filesystem *fs)
 	free(fs->hdlinks.hdl);
 	free(fs->blk_alloc_hint);
 	free(fs->ino_alloc_hint);
+	free(fs->itbs);
+	free(fs->gdt);
+	free(fs->bbms);
+	free(fs->ibms);
+	free(fs->resident_bi);
+	grp_summary_fini(&fs->grps);
+	dirindex_fini(fs);
+	pathcache_fini(fs);
+	cache_fini(&fs->blks);
+	cache_fini(&fs->gds);
+	cache_fini(&fs->blkmaps);
+	cache_fini(&fs->inodes);
+	pool_fini(&fs->blk_pool);
+	pool_fini(&fs->buf_pool);
+	pool_fini(&fs->gd_pool);
+	pool_fini(&fs->blkmap_pool);
+	pool_fini(&fs->nod_pool);
+	unmap_fs(fs);
 	fclose(fs->f);
 	free(fs->sb);
 	free(fs);
@@ -3881,10 +6572,12 @@ static void
 flist_blocks(filesystem *fs, uint32 nod, FILE *fh)
 {
 	blockwalker bw;
-	uint32 bk;
+	uint32 bks[EXTEND_BATCH];
+	uint32 i, n;
 	init_bw(&bw);
-	while((bk = walk_bw(fs, nod, &bw, 0, 0)) != WALK_END)
-		fprintf(fh, " %d", bk);
+	while((n = walk_bw_batch(fs, nod, &bw, bks, EXTEND_BATCH, 0, NULL)))
+		for(i = 0; i < n; i++)
+			fprintf(fh, " %d", bks[i]);
 	fprintf(fh, "\n");
 }
 
@@ -3894,11 +6587,13 @@ list_blocks(filesystem *fs, uint32 nod)
 {
 	int bn = 0;
 	blockwalker bw;
-	uint32 bk;
+	uint32 bks[EXTEND_BATCH];
+	uint32 i, n;
 	init_bw(&bw);
 	printf("blocks in inode %d:", nod);
-	while((bk = walk_bw(fs, nod, &bw, 0, 0)) != WALK_END)
-		printf(" %d", bk), bn++;
+	while((n = walk_bw_batch(fs, nod, &bw, bks, EXTEND_BATCH, 0, NULL)))
+		for(i = 0; i < n; i++)
+			printf(" %d", bks[i]), bn++;
 	printf("\n%d blocks (%d bytes)\n", bn, bn * BLOCKSIZE);
 }
 
@@ -3907,22 +6602,26 @@ static void
 write_blocks(filesystem *fs, uint32 nod, FILE* f)
 {
 	blockwalker bw;
-	uint32 bk;
+	uint32 bks[EXTEND_BATCH];
+	uint32 i, n;
 	nod_info *ni;
 	inode *node = get_nod(fs, nod, &ni);
 	int32 fsize = node->i_size;
 	blk_info *bi;
 
 	init_bw(&bw);
-	while((bk = walk_bw(fs, nod, &bw, 0, 0)) != WALK_END)
+	while((n = walk_bw_batch(fs, nod, &bw, bks, EXTEND_BATCH, 0, NULL)))
 	{
-		if(fsize <= 0)
-			error_msg_and_die("wrong size while saving inode %d", nod);
-		if(fwrite(get_blk(fs, bk, &bi),
-			  ((uint32)fsize > BLOCKSIZE) ? BLOCKSIZE : (uint32)fsize, 1, f) != 1)
-			error_msg_and_die("error while saving inode %d", nod);
-		put_blk(bi);
-		fsize -= BLOCKSIZE;
+		for(i = 0; i < n; i++)
+		{
+			if(fsize <= 0)
+				error_msg_and_die("wrong size while saving inode %d", nod);
+			if(fwrite(get_blk(fs, bks[i], &bi),
+				  ((uint32)fsize > BLOCKSIZE) ? BLOCKSIZE : (uint32)fsize, 1, f) != 1)
+				error_msg_and_die("error while saving inode %d", nod);
+			put_blk(bi);
+			fsize -= BLOCKSIZE;
+		}
 	}
 	put_nod(ni);
 }
@@ -4177,12 +6876,342 @@ print_fs(filesystem *fs)
 	}
 }
 
+// --verify: the block walks don't check that the blocks they return
+// are allocated, so this goes over the whole image once instead.
+// Every block used by the group metadata and by the in-use inodes is
+// noted in a bitmap, which is then compared against the block bitmaps.
+typedef struct
+{
+	filesystem *fs;
+	uint8 *used;		// one bit per block of the filesystem
+	uint8 *xattr;		// the blocks shared as extended attributes
+	unsigned long errors;
+} verifier;
+
+#define VERIFY_BIT(bm,blk) ((bm)[(blk) / 8] & (1 << ((blk) % 8)))
+#define VERIFY_SET(bm,blk) ((bm)[(blk) / 8] |= 1 << ((blk) % 8))
+
+// note that nod (0 for the group metadata) uses blk, returns 0 if it
+// can't
+static int
+verify_use(verifier *v, uint32 blk, uint32 nod)
+{
+	const char *why = NULL;
+
+	if (blk < v->fs->sb->s_first_data_block || blk >= v->fs->sb->s_blocks_count)
+		why = "is outside the filesystem";
+	else if (VERIFY_BIT(v->used, blk))
+		why = "is already in use";
+	if (why) {
+		if (nod)
+			error_msg("block %d of inode %d %s", blk, nod, why);
+		else
+			error_msg("metadata block %d %s", blk, why);
+		v->errors++;
+		return 0;
+	}
+	VERIFY_SET(v->used, blk);
+	return 1;
+}
+
+// note an indirect block and the blocks below it, returns how many
+// blocks that makes
+static uint32
+verify_ind(verifier *v, uint32 nod, uint32 blk, int depth)
+{
+	blkmap_info *bmi;
+	uint32 *b, i, n = 1;
+
+	if (!verify_use(v, blk, nod))
+		return n;
+	b = get_blkmap(v->fs, blk, &bmi);
+	for (i = 0; i < BLOCKSIZE/4; i++) {
+		if (!b[i])
+			continue;
+		if (depth)
+			n += verify_ind(v, nod, b[i], depth - 1);
+		else {
+			verify_use(v, b[i], nod);
+			n++;
+		}
+	}
+	put_blkmap(bmi);
+	return n;
+}
+
+static void
+verify_nod(verifier *v, uint32 nod)
+{
+	nod_info *ni;
+	inode *node;
+	uint32 i, n = 0, acl;
+
+	node = get_nod(v->fs, nod, &ni);
+	acl = node->i_file_acl;
+	if (acl) {
+		// extended attribute blocks may be shared between inodes
+		if (acl < v->fs->sb->s_blocks_count && VERIFY_BIT(v->xattr, acl))
+			;
+		else if (verify_use(v, acl, nod))
+			VERIFY_SET(v->xattr, acl);
+		n++;
+	}
+	// devices and fast symlinks keep something else in i_block
+	if (node->i_blocks / INOBLK > n) {
+		for (i = 0; i <= EXT2_NDIR_BLOCKS; i++)
+			if (node->i_block[i]) {
+				verify_use(v, node->i_block[i], nod);
+				n++;
+			}
+		if (node->i_block[EXT2_IND_BLOCK])
+			n += verify_ind(v, nod, node->i_block[EXT2_IND_BLOCK], 0);
+		if (node->i_block[EXT2_DIND_BLOCK])
+			n += verify_ind(v, nod, node->i_block[EXT2_DIND_BLOCK], 1);
+		if (node->i_block[EXT2_TIND_BLOCK])
+			n += verify_ind(v, nod, node->i_block[EXT2_TIND_BLOCK], 2);
+	}
+	if (n != node->i_blocks / INOBLK) {
+		error_msg("inode %d uses %d blocks but accounts for %d", nod,
+			  n, node->i_blocks / INOBLK);
+		v->errors++;
+	}
+	put_nod(ni);
+}
+
+static void
+verify_fs(filesystem *fs)
+{
+	verifier v;
+	uint32 grp, i, blk, itblsz;
+	uint32 ngroups = GRP_NBGROUPS(fs);
+	uint32 ipg = fs->sb->s_inodes_per_group;
+	blk_info *bi = NULL;
+	gd_info *gi = NULL;
+	groupdescriptor *gd;
+	uint8 *bm = NULL;
+
+	v.fs = fs;
+	v.errors = 0;
+	v.used = calloc(fs->sb->s_blocks_count / 8 + 1, 1);
+	v.xattr = calloc(fs->sb->s_blocks_count / 8 + 1, 1);
+	if (!v.used || !v.xattr)
+		error_msg_and_die(memory_exhausted);
+
+	itblsz = ipg * sizeof(inode) / BLOCKSIZE;
+	for (grp = 0; grp < ngroups; grp++) {
+		gd = get_gd(fs, grp, &gi);
+		verify_use(&v, gd->bg_block_bitmap, 0);
+		verify_use(&v, gd->bg_inode_bitmap, 0);
+		for (i = 0; i < itblsz; i++)
+			verify_use(&v, gd->bg_inode_table + i, 0);
+		bm = GRP_GET_GROUP_IBM(fs, gd, &bi);
+		for (i = 1; i <= ipg; i++)
+			if (allocated(bm, i))
+				verify_nod(&v, grp * ipg + i);
+		GRP_PUT_GROUP_IBM(bi);
+		put_gd(gi);
+	}
+
+	// hold each group's bitmap while going through its blocks.  Like
+	// alloc_blk, count from the first data block, which the
+	// GRP_*_BLOCK macros take to be 1.
+	bm = NULL;
+	for (blk = fs->sb->s_first_data_block; blk < fs->sb->s_blocks_count; blk++) {
+		uint32 off = blk - fs->sb->s_first_data_block;
+
+		if (!VERIFY_BIT(v.used, blk))
+			continue;
+		if (!bm || off / fs->sb->s_blocks_per_group != grp) {
+			if (bm) {
+				GRP_PUT_GROUP_BBM(bi);
+				put_gd(gi);
+			}
+			grp = off / fs->sb->s_blocks_per_group;
+			gd = get_gd(fs, grp, &gi);
+			bm = GRP_GET_GROUP_BBM(fs, gd, &bi);
+		}
+		if (!allocated(bm, off % fs->sb->s_blocks_per_group + 1)) {
+			error_msg("block %d is in use but unallocated", blk);
+			v.errors++;
+		}
+	}
+	if (bm) {
+		GRP_PUT_GROUP_BBM(bi);
+		put_gd(gi);
+	}
+	free(v.used);
+	free(v.xattr);
+	if (v.errors)
+		error_msg_and_die("the filesystem has %lu errors", v.errors);
+}
+
+// SI_atof for a size that has to be a positive number, followed by
+// nothing or one of the multipliers; dies naming what otherwise.
+static float
+SI_size(const char *nptr, const char *what)
+{
+	static const char *const suffixes[] = { "", "Ki", "Mi", "Gi", "k", "M", "G" };
+	char *suffixptr;
+	float f = 0;
+	unsigned i;
+
+	(void) strtod(nptr, &suffixptr);
+	if (suffixptr != nptr) {
+		for (i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++)
+			if (!strcmp(suffixptr, suffixes[i]))
+				break;
+		if (i < sizeof(suffixes) / sizeof(suffixes[0]))
+			f = SI_atof(nptr);
+	}
+	// also rules out NaN and infinity
+	if (!(f > 0 && f < 1e19))
+		error_msg_and_die("invalid %s '%s'", what, nptr);
+	return f;
+}
+
+// The threads of --threads mostly wait on the source storage, so there
+// may be more of them than CPUs, but each has its stack and read ahead.
+#define THREADS_PER_CPU 4
+
+// parses the --threads count, capped at THREADS_PER_CPU per online CPU
+static int
+parse_threads(const char *arg)
+{
+	long n, max = -1;
+	char *end;
+
+	n = strtol(arg, &end, 10);
+	if (end == arg || *end || n < 1)
+		error_msg_and_die("invalid number of threads '%s'", arg);
+#ifdef _SC_NPROCESSORS_ONLN
+	max = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (max < 1)
+		max = 1;
+	if (max > INT_MAX / THREADS_PER_CPU)
+		max = INT_MAX / THREADS_PER_CPU;
+	max *= THREADS_PER_CPU;
+	if (n > max) {
+		error_msg("using %ld threads instead of %s, %d per online CPU",
+			  max, arg, THREADS_PER_CPU);
+		n = max;
+	}
+	return n;
+}
+
+#define MIN_FREE_CACHE 16
+
+static unsigned int
+cache_entries(unsigned long long budget, size_t cost)
+{
+	unsigned long long n = budget / cost;
+
+	if (n < MIN_FREE_CACHE)
+		return MIN_FREE_CACHE;
+	if (n > UINT_MAX / 2)
+		return UINT_MAX / 2;
+	return n;
+}
+
+// Split a memory budget (in bytes) between the caches, instead of the
+// MAX_FREE_CACHE_* defaults.  All the group descriptors are kept
+// (resident or cached) and the inode table index is always there; a
+// quarter of the rest goes to inodes, an eighth to block maps and the
+// rest to blocks.  A cached inode table block or block map is charged
+// its entry plus, unless the image is mapped, the copy of its block:
+// with a mapped image the block is the image's own page.
+static void
+set_cache_budget(filesystem *fs, unsigned long long budget)
+{
+	size_t blkcost = fs->map ? 0 : BLOCKSIZE;
+	unsigned long long fixed;
+
+	if (fs->gdt)
+		fixed = GROUPS_RESIDENT_SIZE(fs);
+	else {
+		fs->gds.max_free_entries = cache_entries(GRP_NBGROUPS(fs), 1);
+		fixed = (unsigned long long) fs->gds.max_free_entries * sizeof(gd_info);
+	}
+	fixed += (unsigned long long) GRP_NBGROUPS(fs) * fs->itbs_per_group
+		* sizeof(*fs->itbs);
+	budget = budget > fixed ? budget - fixed : 0;
+	fs->inodes.max_free_entries = cache_entries(budget / 4,
+		sizeof(nod_info) + blkcost);
+	fs->blkmaps.max_free_entries = cache_entries(budget / 8,
+		sizeof(blkmap_info) + blkcost);
+	fs->blks.max_free_entries = cache_entries(budget - budget / 4 - budget / 8,
+		sizeof(blk_info) + BLOCKSIZE);
+}
+
+static void
+print_cache_stats(const char *name, listcache *c)
+{
+	unsigned long lookups = c->hits + c->misses;
+
+	fprintf(stderr, "%s cache: %u unused entries kept, %lu hits, %lu misses (%.1f%% hits)\n",
+		name, c->max_free_entries, c->hits, c->misses,
+		lookups ? 100.0 * c->hits / lookups : 0.0);
+}
+
+static void
+print_pool_stats(const char *name, pool *p)
+{
+	fprintf(stderr, "%s pool: %lu in use at peak, %lu bytes allocated\n",
+		name, p->peak,
+		p->nslabs * p->per_slab * (unsigned long) p->size);
+}
+
+// report how the image was built, on stderr since stdout may carry
+// the image itself
+static void
+print_stats(filesystem *fs)
+{
+	print_cache_stats("block", &fs->blks);
+	if (fs->gdt)
+		fprintf(stderr, "group descriptors and bitmaps: %u groups resident, %llu bytes\n",
+			GRP_NBGROUPS(fs), GROUPS_RESIDENT_SIZE(fs));
+	else
+		print_cache_stats("group descriptor", &fs->gds);
+	print_cache_stats("block map", &fs->blkmaps);
+	print_cache_stats("inode table", &fs->inodes);
+	fprintf(stderr, "block cache: %lu blocks read, %lu new blocks not read\n",
+		fs->blk_reads, fs->blk_fresh);
+	fprintf(stderr, "block cache: %lu blocks written back in %lu runs, %lu clean blocks dropped\n",
+		fs->blk_writebacks, fs->blk_writeruns, fs->blk_clean_drops);
+	fprintf(stderr, "allocation: %lu blocks reserved in %lu contiguous runs\n",
+		fs->resv_blocks, fs->resv_runs);
+	fprintf(stderr, "allocation: group summary rebuilt %lu times\n",
+		fs->grps.rebuilds);
+	fprintf(stderr, "allocation: %lu block allocations left the home group, %lu groups scanned\n",
+		fs->grps.fallbacks, fs->grps.fallback_grps);
+	fprintf(stderr, "directory index: %lu directories indexed, %lu lookups\n",
+		fs->dirindex_builds, fs->dirindex_lookups);
+	fprintf(stderr, "directory index: %lu directories hashed\n",
+		fs->dx_dirs);
+	fprintf(stderr, "hard links: %lu files copied once, %lu more links made to them\n",
+		(unsigned long) fs->hdlinks.count, fs->hdlinks.links);
+	fprintf(stderr, "file data: %llu bytes copied with copy_file_range\n",
+		fs->copy_range_bytes);
+	fprintf(stderr, "read ahead: %lu files, %llu bytes\n",
+		fs->prefetch_files, fs->prefetch_bytes);
+	fprintf(stderr, "path cache: %lu paths, %lu hits, %lu misses, %lu flushes\n",
+		(unsigned long) fs->npaths, fs->path_hits, fs->path_misses,
+		fs->path_flushes);
+	print_pool_stats("block info", &fs->blk_pool);
+	print_pool_stats("block buffer", &fs->buf_pool);
+	print_pool_stats("group descriptor", &fs->gd_pool);
+	print_pool_stats("block map", &fs->blkmap_pool);
+	print_pool_stats("inode table", &fs->nod_pool);
+}
+
 static void
 finish_fs(filesystem *fs)
 {
 	uint32 i, nbgroups, gdsz;
 
-	if (cache_flush(&fs->inodes))
+	store_groups(fs);
+	evict_itbs(fs, 0);
+	if (fs->inodes.entries)
 		error_msg_and_die("entry mismatch on inode cache flush");
 	if (cache_flush(&fs->blkmaps))
 		error_msg_and_die("entry mismatch on blockmap cache flush");
@@ -4193,10 +7222,8 @@ finish_fs(filesystem *fs)
 	if(fs->swapit)
 		swap_sb(fs->sb);
 	// write primary superblock
-	if (fseek(fs->f, SUPERBLOCK_OFFSET, SEEK_SET))
-		perror_msg_and_die("fseek");
-	if(fwrite(fs->sb, SUPERBLOCK_SIZE, 1, fs->f) != 1)
-		perror_msg_and_die("output filesystem superblock");
+	image_write(fs, SUPERBLOCK_OFFSET, fs->sb, SUPERBLOCK_SIZE,
+		    "output filesystem superblock");
 
 	// write backup superblock+GDT copies for sparse_super groups
 	if(fs->swapit)
@@ -4214,10 +7241,8 @@ finish_fs(filesystem *fs)
 		gdt_buf = malloc(gdsz * BLOCKSIZE);
 		if(!gdt_buf)
 			error_msg_and_die("finish_fs: out of memory");
-		if(fseek(fs->f, GDS_START * BLOCKSIZE, SEEK_SET))
-			perror_msg_and_die("fseek gdt read");
-		if(fread(gdt_buf, BLOCKSIZE, gdsz, fs->f) != gdsz)
-			perror_msg_and_die("fread gdt");
+		image_read(fs, ((off_t) GDS_START) * BLOCKSIZE, gdt_buf,
+			   gdsz * BLOCKSIZE, "gdt");
 
 		for(i = 1; i < nbgroups; i++)
 		{
@@ -4234,18 +7259,14 @@ finish_fs(filesystem *fs)
 			fs->sb->s_block_group_nr = i;
 			if(fs->swapit)
 				swap_sb(fs->sb);
-			if(fseek(fs->f, sb_offset, SEEK_SET))
-				perror_msg_and_die("fseek backup sb");
-			if(fwrite(fs->sb, SUPERBLOCK_SIZE, 1, fs->f) != 1)
-				perror_msg_and_die("write backup superblock");
+			image_write(fs, sb_offset, fs->sb, SUPERBLOCK_SIZE,
+				    "backup superblock");
 			if(fs->swapit)
 				swap_sb(fs->sb);
 
 			// write backup GDT
-			if(fseek(fs->f, sb_offset + BLOCKSIZE, SEEK_SET))
-				perror_msg_and_die("fseek backup gdt");
-			if(fwrite(gdt_buf, BLOCKSIZE, gdsz, fs->f) != gdsz)
-				perror_msg_and_die("write backup gdt");
+			image_write(fs, sb_offset + BLOCKSIZE, gdt_buf,
+				    gdsz * BLOCKSIZE, "backup gdt");
 		}
 		free(gdt_buf);
 
@@ -4257,10 +7278,15 @@ finish_fs(filesystem *fs)
 		if(fs->swapit)
 			swap_sb(fs->sb);
 	}
+#if HAVE_MMAP
+	// wait for the write back, to report its errors as stdio would
+	if (fs->map && msync(fs->map, fs->mapsize, MS_SYNC))
+		perror_msg_and_die("writing output filesystem image");
+#endif
 }
 
 static void
-populate_fs(filesystem *fs, struct fslayer *fslayers, int nlayers, int squash_uids, int squash_perms, int copy_xattrs, uint32 fs_timestamp, struct stats *stats)
+populate_fs(filesystem *fs, struct fslayer *fslayers, int nlayers, int squash_uids, int squash_perms, int copy_xattrs, int scan_threads, uint32 fs_timestamp, struct stats *stats)
 {
 	int i;
 	for(i = 0; i < nlayers; i++)
@@ -4319,9 +7345,29 @@ populate_fs(filesystem *fs, struct fslayer *fslayers, int nlayers, int squash_ui
 					fprintf(stderr, "copying from directory %s\n", fslayers[i].path);
 				if((pdir = open(".", O_RDONLY)) < 0)
 					perror_msg_and_die(".");
+				// the only chdir: the scanner and the prefetcher
+				// open paths relative to the root of the layer,
+				// and read xattrs by path from this current dir
 				if(chdir(fslayers[i].path) < 0)
 					perror_msg_and_die(fslayers[i].path);
-				add2fs_from_dir(fs, nod, squash_uids, squash_perms, copy_xattrs, fs_timestamp, stats);
+				if(!fs)
+					fslayers[i].manifest = scan_dir(copy_xattrs, scan_threads, stats);
+				else {
+					if(!fslayers[i].manifest)
+						fslayers[i].manifest = scan_dir(copy_xattrs, scan_threads, NULL);
+					struct prefetcher *pf = NULL;
+					int rootfd;
+					if((rootfd = open(".", O_RDONLY | O_DIRECTORY)) < 0)
+						perror_msg_and_die(fslayers[i].path);
+					if(scan_threads > 1)
+						pf = prefetch_start(fs, fslayers[i].manifest, scan_threads);
+					add2fs_from_dir(fs, rootfd, nod, fslayers[i].manifest, pf, squash_uids, squash_perms, fs_timestamp);
+					close(rootfd);
+					if(pf)
+						prefetch_stop(pf);
+					free_srcdir(fslayers[i].manifest);
+					fslayers[i].manifest = NULL;
+				}
 				if(fchdir(pdir) < 0)
 					perror_msg_and_die("fchdir");
 				if(close(pdir) < 0)
@@ -4375,6 +7421,11 @@ showhelp(void)
 	"  -U, --squash-uids                 Squash owners making all files be owned by root.\n"
 	"  -P, --squash-perms                Squash permissions on all files.\n"
 	"  -X, --xattrs                      Copy extended attributes from source files.\n"
+	"      --no-mmap                     Use stdio instead of mapping the image.\n"
+	"      --cache-memory <bytes>        Memory to use for caching image metadata and blocks.\n"
+	"      --dir-index                   Use hashed b-trees for directories of more than one block.\n"
+	"      --threads <count>             Threads reading the source directories and files.\n"
+	"      --verify                      Check the block allocation of the finished image.\n"
 	"  -h, --help\n"
 	"  -V, --version\n"
 	"  -v, --verbose\n\n"
@@ -4384,6 +7435,13 @@ showhelp(void)
 #define MAX_DOPT 128
 #define MAX_GOPT 128
 
+// long options without a short equivalent
+#define OPT_NO_MMAP 256
+#define OPT_CACHE_MEMORY 257
+#define OPT_DIR_INDEX 258
+#define OPT_THREADS 259
+#define OPT_VERIFY 260
+
 #define MAX_FILENAME 255
 
 extern char* optarg;
@@ -4429,9 +7487,14 @@ main(int argc, char **argv)
 	int squash_uids = 0;
 	int squash_perms = 0;
 	int copy_xattrs = 0;
+	int dir_index = 0;
+	int scan_threads = 1;
+	int verify = 0;
 	uint16 endian = 1;
 	int bigendian = !*(char*)&endian;
 	char *volumelabel = NULL;
+	char *cache_memory = getenv("GENEXT2FS_CACHE_MEMORY");
+	float cache_budget = 0;
 	filesystem *fs;
 	int i;
 	int c;
@@ -4461,6 +7524,11 @@ main(int argc, char **argv)
 	  { "help",		no_argument,		NULL, 'h' },
 	  { "version",		no_argument,		NULL, 'V' },
 	  { "verbose",		no_argument,		NULL, 'v' },
+	  { "no-mmap",		no_argument,		NULL, OPT_NO_MMAP },
+	  { "cache-memory",	required_argument,	NULL, OPT_CACHE_MEMORY },
+	  { "dir-index",	no_argument,		NULL, OPT_DIR_INDEX },
+	  { "threads",		required_argument,	NULL, OPT_THREADS },
+	  { "verify",		no_argument,		NULL, OPT_VERIFY },
 	  { 0, 0, 0, 0}
 	} ;
 
@@ -4479,14 +7547,17 @@ main(int argc, char **argv)
 				break;
 			case 'd':
 				layers[nlayers].type = FSLAYER_DIR;
+				layers[nlayers].manifest = NULL;
 				layers[nlayers++].path = optarg;
 				break;
 			case 'D':
 				layers[nlayers].type = FSLAYER_TABLE;
+				layers[nlayers].manifest = NULL;
 				layers[nlayers++].path = optarg;
 				break;
 			case 'a':
 				layers[nlayers].type = FSLAYER_TAR;
+				layers[nlayers].manifest = NULL;
 				layers[nlayers++].path = optarg;
 				break;
 			case 'B':
@@ -4545,6 +7616,21 @@ main(int argc, char **argv)
 				verbose = 1;
 				showversion();
 				break;
+			case OPT_NO_MMAP:
+				use_mmap = 0;
+				break;
+			case OPT_CACHE_MEMORY:
+				cache_memory = optarg;
+				break;
+			case OPT_DIR_INDEX:
+				dir_index = 1;
+				break;
+			case OPT_THREADS:
+				scan_threads = parse_threads(optarg);
+				break;
+			case OPT_VERIFY:
+				verify = 1;
+				break;
 			default:
 				error_msg_and_die("Note: options have changed, see --help or the man page.");
 		}
@@ -4560,6 +7646,8 @@ main(int argc, char **argv)
 		error_msg_and_die("Valid block sizes: 1024, 2048 or 4096.");
 	if(creator_os < 0)
 		error_msg_and_die("Creator OS unknown.");
+	if (cache_memory != NULL && *cache_memory)
+		cache_budget = SI_size(cache_memory, "cache memory size");
 
 	int numstdin = 0;
 	for(i = 0; i < nlayers; i++)
@@ -4587,7 +7675,7 @@ main(int argc, char **argv)
 		stats.ninodes = 0;
 		stats.nblocks = 0;
 
-		populate_fs(NULL, layers, nlayers, squash_uids, squash_perms, copy_xattrs, fs_timestamp, &stats);
+		populate_fs(NULL, layers, nlayers, squash_uids, squash_perms, copy_xattrs, scan_threads, fs_timestamp, &stats);
 
 		if(reserved_frac == -1)
 			reserved_frac = 1.0 * RESERVED_BLOCKS;
@@ -4729,11 +7817,15 @@ main(int argc, char **argv)
 			     fs_timestamp, creator_os, bigendian, fsout);
 		fs_upgrade_rev1_largefile(fs);
 	}
+	if (cache_budget > 0)
+		set_cache_budget(fs, cache_budget);
 	if (volumelabel != NULL)
 		strncpy((char *)fs->sb->s_volume_name, volumelabel,
 			sizeof(fs->sb->s_volume_name));
 	
-	populate_fs(fs, layers, nlayers, squash_uids, squash_perms, copy_xattrs, fs_timestamp, NULL);
+	populate_fs(fs, layers, nlayers, squash_uids, squash_perms, copy_xattrs, scan_threads, fs_timestamp, NULL);
+	if (dir_index)
+		dx_index_dirs(fs);
 
 	if(emptyval) {
 		uint32 b;
@@ -4745,11 +7837,14 @@ main(int argc, char **argv)
 				blk_info *bi2;
 				memset(get_blk(fs, b, &bi2), emptyval,
 				       BLOCKSIZE);
+				mark_blk_dirty(bi2);
 				put_blk(bi2);
 			}
 			GRP_PUT_BLOCK_BITMAP(bi,gi);
 		}
 	}
+	if(verify)
+		verify_fs(fs);
 	if(verbose)
 		print_fs(fs);
 	for(i = 0; i < gidx; i++)
@@ -4771,8 +7866,10 @@ main(int argc, char **argv)
 		fclose(fh);
 	}
 	finish_fs(fs);
-	if(strcmp(fsout, "-") == 0)
-		copy_file(fs, stdout, fs->f, fs->sb->s_blocks_count);
+	if(verbose)
+		print_stats(fs);
+	if(strcmp(fsout, "-") == 0 && !fs->in_stdout)
+		stream_fs(fs, stdout);
 
 	free_fs(fs);
 	return 0;
@@ -0,0 +1,124 @@
+/* vi: set sw=8 ts=8: */
+// pool.h
+//
+// ext2 filesystem generator for embedded systems
+//
+// Please direct support requests to https://github.com/bestouff/genext2fs/issues
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; version
+// 2 of the License.
+
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#if STDC_HEADERS
+# include <stdlib.h>
+# include <stddef.h>
+#else
+# if HAVE_STDLIB_H
+#  include <stdlib.h>
+# endif
+# if HAVE_STDDEF_H
+#  include <stddef.h>
+# endif
+#endif
+
+/* Fixed size object pool.  Objects are carved out of slabs allocated
+ * a few at a time, and released objects go on a free list to be handed
+ * out again.  Slabs are only given back to the system by pool_fini. */
+
+#define POOL_ALIGN 16
+
+typedef struct pool_free
+{
+    struct pool_free *next;
+} pool_free;
+
+typedef union pool_slab
+{
+    union pool_slab *next;
+    char align[POOL_ALIGN];
+} pool_slab;
+
+typedef struct
+{
+    size_t size;
+    unsigned int per_slab;
+    pool_free *free_list;
+    pool_slab *slabs;
+
+    unsigned long in_use;
+    unsigned long peak;
+    unsigned long nslabs;
+} pool;
+
+static inline void
+pool_init(pool *p, size_t size, unsigned int per_slab)
+{
+    if (size < sizeof(pool_free))
+        size = sizeof(pool_free);
+    p->size = (size + POOL_ALIGN - 1) & ~(size_t) (POOL_ALIGN - 1);
+    p->per_slab = per_slab;
+    p->free_list = NULL;
+    p->slabs = NULL;
+    p->in_use = 0;
+    p->peak = 0;
+    p->nslabs = 0;
+}
+
+/* Get an object, NULL if memory runs out */
+static inline void *
+pool_get(pool *p)
+{
+    pool_free *obj;
+
+    if (!p->free_list) {
+        pool_slab *slab;
+        char *o;
+        unsigned int i;
+
+        slab = malloc(sizeof(*slab) + p->size * p->per_slab);
+        if (!slab)
+            return NULL;
+        slab->next = p->slabs;
+        p->slabs = slab;
+        p->nslabs++;
+        o = (char *) (slab + 1);
+        for (i = 0; i < p->per_slab; i++, o += p->size) {
+            ((pool_free *) o)->next = p->free_list;
+            p->free_list = (pool_free *) o;
+        }
+    }
+    obj = p->free_list;
+    p->free_list = obj->next;
+    if (++p->in_use > p->peak)
+        p->peak = p->in_use;
+    return obj;
+}
+
+static inline void
+pool_put(pool *p, void *obj)
+{
+    pool_free *f = obj;
+
+    f->next = p->free_list;
+    p->free_list = f;
+    p->in_use--;
+}
+
+static inline void
+pool_fini(pool *p)
+{
+    pool_slab *slab, *next;
+
+    for (slab = p->slabs; slab; slab = next) {
+        next = slab->next;
+        free(slab);
+    }
+    p->slabs = NULL;
+    p->free_list = NULL;
+}
+
+#endif /* __POOL_H__ */
@@ -290,6 +290,51 @@ fi
 $pass && echo "PASS" || { echo "FAIL"; exit 1; }
 gen_cleanup
 
+# ---- Many hardlinks (link table growth) ----
+echo "Testing many hardlinks (100 files, 233 names)"
+gen_setup
+mkdir $test_dir/a $test_dir/b $test_dir/c
+for n in $(seq 1 100); do
+	echo "file $n" > $test_dir/a/f$n
+	ln $test_dir/a/f$n $test_dir/b/f$n
+	if [ $((n % 3)) = 0 ]; then
+		ln $test_dir/a/f$n $test_dir/c/f$n
+	fi
+done
+TZ=UTC-11 find $test_dir -exec touch -h -t 200502070321.43 {} +
+./genext2fs -v -B 1024 -b 0 -d $test_dir -f -o Linux $test_img > /dev/null 2> t_hl.log
+pass=true
+if ! /usr/sbin/e2fsck -fn $test_img > /dev/null 2>&1; then
+	echo "  e2fsck (link counts): FAIL"; pass=false
+fi
+if grep -q '^hard links: 100 files copied once, 133 more links made to them' t_hl.log; then
+	echo "  -v link count: PASS"
+else
+	echo "  -v link count: FAIL ($(grep '^hard links' t_hl.log))"; pass=false
+fi
+# every name of f<n> in a, b and c is the same inode, and each f<n> its own
+for d in a b c; do
+	/usr/sbin/debugfs -R "ls -l $d" $test_img 2>/dev/null | awk -v d=$d '$NF ~ /^f/ { print d, $NF, $1 }'
+done > t_hl.ino
+shared=$(awk '{ ino[$2] = ino[$2] ? ino[$2] : $3; if (ino[$2] != $3) bad++ } END { print bad + 0 }' t_hl.ino)
+distinct=$(awk '$1 == "a" { print $3 }' t_hl.ino | sort -u | wc -l)
+names=$(wc -l < t_hl.ino)
+if [ "$shared" = 0 ] && [ "$distinct" = 100 ] && [ "$names" = 233 ]; then
+	echo "  shared inodes: PASS"
+else
+	echo "  shared inodes: FAIL ($shared mismatches, $distinct inodes, $names names)"; pass=false
+fi
+links3=$(/usr/sbin/debugfs -R "stat c/f99" $test_img 2>/dev/null | grep -o 'Links: [0-9]*' | awk '{print $2}')
+links2=$(/usr/sbin/debugfs -R "stat b/f100" $test_img 2>/dev/null | grep -o 'Links: [0-9]*' | awk '{print $2}')
+if [ "$links3" = 3 ] && [ "$links2" = 2 ]; then
+	echo "  link counts: PASS"
+else
+	echo "  link counts: FAIL (f99 $links3, f100 $links2)"; pass=false
+fi
+$pass && echo "PASS" || { echo "FAIL"; exit 1; }
+rm -f t_hl.log t_hl.ino
+gen_cleanup
+
 # ---- Deep directory nesting (20 levels) ----
 echo "Testing deep directory nesting (20 levels)"
 gen_setup
@@ -405,3 +450,245 @@ else
 fi
 $pass && echo "PASS" || { echo "FAIL"; exit 1; }
 gen_cleanup
+
+# ---- Image backends (mmap, --no-mmap, stdout) ----
+echo "Testing image backends (mmap, --no-mmap, stdout)"
+gen_setup
+for d in $(seq 1 5); do
+	mkdir "$test_dir/dir$d"
+	for f in $(seq 1 40); do
+		echo "content $d/$f" > "$test_dir/dir$d/file$f.txt"
+	done
+done
+dd if=/dev/urandom of=$test_dir/big bs=1024 count=600 2>/dev/null
+TZ=UTC-11 find $test_dir -exec touch -h -t 200502070321.43 {} +
+./genext2fs -B 1024 -b 0 -d $test_dir -f -o Linux $test_img
+./genext2fs --no-mmap -B 1024 -b 0 -d $test_dir -f -o Linux t_nommap.img
+./genext2fs -B 1024 -b 0 -d $test_dir -f -o Linux - > t_stdout.img
+./genext2fs --no-mmap -B 1024 -b 0 -d $test_dir -f -o Linux - | cat > t_pipe.img
+# stdout open read/write on a file that already holds something bigger
+dd if=/dev/urandom of=t_over.img bs=1024 count=4096 2>/dev/null
+./genext2fs -B 1024 -b 0 -d $test_dir -f -o Linux - 1<>t_over.img
+dd if=/dev/urandom of=t_overnm.img bs=1024 count=4096 2>/dev/null
+./genext2fs --no-mmap -B 1024 -b 0 -d $test_dir -f -o Linux - 1<>t_overnm.img
+# and on the image -x starts from
+./genext2fs -B 1024 -b 2048 -N 128 -f -o Linux t_x.img
+./genext2fs -B 1024 -x t_x.img -d $test_dir/dir1 -f -o Linux t_xref.img
+./genext2fs -B 1024 -x t_x.img -d $test_dir/dir1 -f -o Linux - 1<>t_x.img
+pass=true
+if cmp -s t_xref.img t_x.img; then
+	echo "  -x onto stdout: PASS"
+else
+	echo "  -x onto stdout: FAIL (differs from -x to a file)"; pass=false
+fi
+if ! /usr/sbin/e2fsck -fn $test_img > /dev/null 2>&1; then
+	echo "  e2fsck: FAIL"; pass=false
+fi
+for img in t_nommap.img t_stdout.img t_pipe.img t_over.img t_overnm.img; do
+	if cmp -s $test_img $img; then
+		echo "  $img: PASS"
+	else
+		echo "  $img: FAIL (differs from mmap image)"; pass=false
+	fi
+done
+$pass && echo "PASS" || { echo "FAIL"; exit 1; }
+rm -f t_nommap.img t_stdout.img t_pipe.img t_over.img t_overnm.img t_x.img t_xref.img
+gen_cleanup
+
+# ---- Cache size (--cache-memory, GENEXT2FS_CACHE_MEMORY) ----
+echo "Testing cache size (--cache-memory)"
+gen_setup
+for d in $(seq 1 10); do
+	mkdir "$test_dir/dir$d"
+	for f in $(seq 1 30); do
+		echo "content $d/$f" > "$test_dir/dir$d/file$f.txt"
+	done
+done
+dd if=/dev/urandom of=$test_dir/big bs=1024 count=600 2>/dev/null
+TZ=UTC-11 find $test_dir -exec touch -h -t 200502070321.43 {} +
+./genext2fs -B 1024 -b 0 -d $test_dir -f -o Linux $test_img
+./genext2fs --cache-memory 64k -B 1024 -b 0 -d $test_dir -f -o Linux t_small.img
+./genext2fs --cache-memory 256Mi -B 1024 -b 0 -d $test_dir -f -o Linux t_large.img
+./genext2fs --no-mmap --cache-memory 64k -B 1024 -b 0 -d $test_dir -f -o Linux t_smallnm.img
+GENEXT2FS_CACHE_MEMORY=64k ./genext2fs -B 1024 -b 0 -d $test_dir -f -o Linux t_env.img
+pass=true
+for img in t_small.img t_large.img t_smallnm.img t_env.img; do
+	if cmp -s $test_img $img; then
+		echo "  $img: PASS"
+	else
+		echo "  $img: FAIL (differs from default cache image)"; pass=false
+	fi
+done
+for bad in 0 -5 abc 12x; do
+	if ./genext2fs --cache-memory $bad -B 1024 -b 0 -d $test_dir -f -o Linux t_bad.img 2>/dev/null; then
+		echo "  --cache-memory $bad: FAIL (accepted)"; pass=false
+	fi
+	if GENEXT2FS_CACHE_MEMORY=$bad ./genext2fs -B 1024 -b 0 -d $test_dir -f -o Linux t_bad.img 2>/dev/null; then
+		echo "  GENEXT2FS_CACHE_MEMORY=$bad: FAIL (accepted)"; pass=false
+	fi
+done
+$pass && echo "PASS" || { echo "FAIL"; exit 1; }
+rm -f t_small.img t_large.img t_smallnm.img t_env.img t_bad.img
+gen_cleanup
+
+# ---- Hashed directories (--dir-index) ----
+echo "Testing hashed directories (--dir-index)"
+gen_setup
+mkdir $test_dir/big $test_dir/small
+for f in $(seq 1 400); do
+	echo "content $f" > "$test_dir/big/a_rather_long_file_name_$f.txt"
+done
+echo "small" > $test_dir/small/file.txt
+TZ=UTC-11 find $test_dir -exec touch -h -t 200502070321.43 {} +
+./genext2fs --dir-index -B 1024 -b 0 -d $test_dir -f -o Linux $test_img
+pass=true
+if ! /usr/sbin/e2fsck -fn $test_img > /dev/null 2>&1; then
+	echo "  e2fsck: FAIL"; pass=false
+fi
+if /usr/sbin/dumpe2fs -h $test_img 2>/dev/null | grep -q '^Filesystem features:.*dir_index'; then
+	echo "  dir_index feature: PASS"
+else
+	echo "  dir_index feature: FAIL"; pass=false
+fi
+flags_big=$(/usr/sbin/debugfs -R "stat big" $test_img 2>/dev/null | sed -n 's/.*Flags: \(0x[0-9a-f]*\).*/\1/p')
+flags_small=$(/usr/sbin/debugfs -R "stat small" $test_img 2>/dev/null | sed -n 's/.*Flags: \(0x[0-9a-f]*\).*/\1/p')
+if [ "$flags_big" = "0x1000" ] && [ "$flags_small" = "0x0" ]; then
+	echo "  index flags: PASS"
+else
+	echo "  index flags: FAIL (big $flags_big, small $flags_small)"; pass=false
+fi
+for f in 1 200 400; do
+	val=$(/usr/sbin/debugfs -R "cat big/a_rather_long_file_name_$f.txt" $test_img 2>/dev/null)
+	if [ "$val" != "content $f" ]; then
+		echo "  big/...$f.txt: FAIL (got '$val')"; pass=false
+	fi
+done
+# adding to a hashed directory without --dir-index makes it linear again
+mv $test_img t_base.img
+gen_cleanup
+gen_setup
+mkdir $test_dir/big
+echo "added" > $test_dir/big/added.txt
+TZ=UTC-11 find $test_dir -exec touch -h -t 200502070321.43 {} +
+./genext2fs -B 1024 -x t_base.img -d $test_dir -f -o Linux $test_img
+if ! /usr/sbin/e2fsck -fn $test_img > /dev/null 2>&1; then
+	echo "  -x e2fsck: FAIL"; pass=false
+fi
+flags_big=$(/usr/sbin/debugfs -R "stat big" $test_img 2>/dev/null | sed -n 's/.*Flags: \(0x[0-9a-f]*\).*/\1/p')
+val=$(/usr/sbin/debugfs -R "cat big/added.txt" $test_img 2>/dev/null)
+if [ "$flags_big" = "0x0" ] && [ "$val" = "added" ]; then
+	echo "  -x without --dir-index: PASS"
+else
+	echo "  -x without --dir-index: FAIL (flags $flags_big, got '$val')"; pass=false
+fi
+# enough entries for the root to point at index blocks
+gen_cleanup
+gen_setup
+mkdir $test_dir/many
+for f in $(seq 1 20000); do
+	: > "$test_dir/many/file_$f"
+done
+echo "content 12345" > $test_dir/many/file_12345
+TZ=UTC-11 find $test_dir -exec touch -h -t 200502070321.43 {} +
+./genext2fs --dir-index -B 1024 -b 40000 -d $test_dir -f -o Linux $test_img
+if ! /usr/sbin/e2fsck -fn $test_img > /dev/null 2>&1; then
+	echo "  two levels e2fsck: FAIL"; pass=false
+fi
+levels=$(/usr/sbin/debugfs -R "htree many" $test_img 2>/dev/null | sed -n 's/.*Indirect levels: \([0-9]*\).*/\1/p')
+val=$(/usr/sbin/debugfs -R "cat many/file_12345" $test_img 2>/dev/null)
+if [ "$levels" = "1" ] && [ "$val" = "content 12345" ]; then
+	echo "  two levels: PASS"
+else
+	echo "  two levels: FAIL (levels '$levels', got '$val')"; pass=false
+fi
+$pass && echo "PASS" || { echo "FAIL"; exit 1; }
+rm -f t_base.img
+gen_cleanup
+
+# ---- Parallel source scan (--threads) ----
+echo "Testing parallel source scan and read ahead (--threads)"
+gen_setup
+for d in $(seq 1 8); do
+	mkdir -p "$test_dir/dir$d/sub"
+	for f in $(seq 1 30); do
+		echo "content $d/$f" > "$test_dir/dir$d/file$f.txt"
+	done
+	echo "nested $d" > "$test_dir/dir$d/sub/nested.txt"
+	ln -s "file1.txt" "$test_dir/dir$d/link"
+	ln "$test_dir/dir$d/file2.txt" "$test_dir/dir$d/hardlink"
+done
+dd if=/dev/urandom of=$test_dir/dir1/big bs=1024 count=1100 2>/dev/null
+TZ=UTC-11 find $test_dir -exec touch -h -t 200502070321.43 {} +
+./genext2fs -B 1024 -b 0 -d $test_dir -f -o Linux $test_img
+./genext2fs --threads 4 -B 1024 -b 0 -d $test_dir -f -o Linux t_threads.img
+# capped at a few threads per CPU
+./genext2fs --threads 100000 -B 1024 -b 0 -d $test_dir -f -o Linux t_many.img
+pass=true
+if ! /usr/sbin/e2fsck -fn t_threads.img > /dev/null 2>&1; then
+	echo "  e2fsck: FAIL"; pass=false
+fi
+for img in t_threads.img t_many.img; do
+	if cmp -s $test_img $img; then
+		echo "  $img: PASS"
+	else
+		echo "  $img: FAIL (differs from single threaded image)"; pass=false
+	fi
+done
+for bad in 0 -1 abc 4x; do
+	if ./genext2fs --threads $bad -B 1024 -b 0 -d $test_dir -f -o Linux t_bad.img 2>/dev/null; then
+		echo "  --threads $bad: FAIL (accepted)"; pass=false
+	fi
+done
+$pass && echo "PASS" || { echo "FAIL"; exit 1; }
+rm -f t_threads.img t_many.img t_bad.img
+gen_cleanup
+
+# ---- Image verification (--verify) ----
+echo "Testing image verification (--verify)"
+gen_setup
+mkdir $test_dir/dir
+for f in $(seq 1 20); do
+	echo "content $f" > "$test_dir/dir/file$f.txt"
+done
+ln -s "dir/file1.txt" $test_dir/short
+ln -s "$(printf 'long/%.0s' $(seq 1 20))target" $test_dir/long
+dd if=/dev/urandom of=$test_dir/big bs=1024 count=300 2>/dev/null
+TZ=UTC-11 find $test_dir -exec touch -h -t 200502070321.43 {} +
+./genext2fs -B 1024 -b 0 -d $test_dir -f -o Linux t_base.img
+pass=true
+if ./genext2fs --verify -B 1024 -b 0 -d $test_dir -f -o Linux $test_img; then
+	if cmp -s t_base.img $test_img; then
+		echo "  --verify: PASS"
+	else
+		echo "  --verify: FAIL (image differs)"; pass=false
+	fi
+else
+	echo "  --verify: FAIL (good image rejected)"; pass=false
+fi
+# with 4k blocks the groups start at block 0 rather than 1
+if ./genext2fs --verify -B 4096 -b 0 -d $test_dir -f -o Linux t_4k.img; then
+	blk=$(/usr/sbin/debugfs -R "bmap big 20" t_4k.img 2>/dev/null)
+	/usr/sbin/debugfs -w -R "freeb $blk" t_4k.img > /dev/null 2>&1
+	rm -f $test_img
+	if ./genext2fs --verify -B 4096 -x t_4k.img -f -o Linux $test_img 2>&1 \
+	   | grep -q "block $blk is in use but unallocated"; then
+		echo "  --verify -B 4096: PASS"
+	else
+		echo "  --verify -B 4096: FAIL (block $blk not reported)"; pass=false
+	fi
+else
+	echo "  --verify -B 4096: FAIL (good image rejected)"; pass=false
+fi
+rm -f t_4k.img
+# free a block of big behind the filesystem's back
+blk=$(/usr/sbin/debugfs -R "bmap big 100" t_base.img 2>/dev/null)
+/usr/sbin/debugfs -w -R "freeb $blk" t_base.img > /dev/null 2>&1
+rm -f $test_img
+if ./genext2fs --verify -B 1024 -x t_base.img -f -o Linux $test_img 2>/dev/null; then
+	echo "  unallocated block $blk: FAIL (not detected)"; pass=false
+else
+	echo "  unallocated block $blk: PASS"
+fi
+$pass && echo "PASS" || { echo "FAIL"; exit 1; }
+rm -f t_base.img
+gen_cleanup